@@ -0,0 +1,175 @@
+#include "mmu.h"
+#include "mrc.h"
+#include "getopt.h"
+
+
+// ====================|  Main  |===========================
+int main(int argc, char **argv) {
+    simulator_config config;
+    simulator_options& options = config.options;
+    int decode_threads = 1;
+    mrc_config mrc;
+    bool mrc_mode = false;
+    int c;
+    std::string input_file = "../lab3_assign/in1";
+    std::string rfile = "rfile";
+    std::string delta_file;
+
+    while ((c = getopt(argc,argv,"f:a:o:j:t:p:m:s:b:d:lxyfa")) != -1 ){
+        switch(c) {
+            case 'f':
+                config.num_frames = atoi(optarg);
+                break;
+            case 'j':
+                decode_threads = atoi(optarg);
+                break;
+            case 't':
+                config.tau = strtoul(optarg, nullptr, 10);
+                break;
+            case 'l':
+                config.load_control = true;
+                break;
+            case 'p':
+                // <lower>:<upper> page fault frequency bounds, faults per 1000 references
+                config.local_replacement = true;
+                if (sscanf(optarg, "%d:%d", &config.pff_lower, &config.pff_upper) != 2) {
+                    std::cout << "Invalid page fault frequency bounds" << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'm':
+                // <rate>[:<max keys>] sampled miss ratio curve instead of a simulation
+                mrc_mode = true;
+                if (sscanf(optarg, "%lf:%zu", &mrc.rate, &mrc.max_keys) < 1) {
+                    std::cout << "Invalid sampling rate" << std::endl;
+                    exit(1);
+                }
+                break;
+            case 's':
+                // <slow frames>[:<cost per reference>] second, slower memory tier
+                if (sscanf(optarg, "%d:%lu", &config.slow_frames, &config.slow_access_cost) < 1) {
+                    std::cout << "Invalid slow tier" << std::endl;
+                    exit(1);
+                }
+                break;
+            case 'b':
+                // pages per swap I/O
+                config.swap_cluster = atoi(optarg);
+                break;
+            case 'd':
+                // PTE/frame changes per instruction, for mmu-replay
+                delta_file = optarg;
+                break;
+            case 'a':
+                config.algo = optarg[0];
+                break;
+            case 'o':
+                if (optarg && *optarg) {
+                    for (int i = 0; optarg[i] != '\0'; i++) {
+                        switch(optarg[i]) {
+                            case 'O':
+                                options.do_show_output = true;
+                                break;
+                            case 'P':
+                                options.do_show_pagetable = true;
+                                break;
+                            case 'F':
+                                options.do_show_frametable = true;
+                                break;
+                            case 'S':
+                                options.do_show_stats = true;
+                                break;
+                            case 'x':
+                                options.x_flag = true;
+                                break;
+                            case 'y':  
+                                options.y_flag = true;
+                                options.x_flag = false;
+                                break;
+                            case 'f':
+                                options.f_flag = true;
+                                options.do_verbose = true;
+                            case 'a':
+                                options.a_flag = true;
+                                break;
+                        }
+                    }
+                }
+
+        }   
+    }
+
+    if ((argc - optind) == 2) {
+        input_file = argv[optind];
+        rfile = argv[optind+1];
+    }
+    else if ((argc - optind) == 1) {
+        input_file = argv[optind];
+    }
+    else if ((argc - optind) == 0) {
+    }
+    else {
+        exit(1);
+    }
+
+    if (mrc_mode) {
+        try {
+            process_arena processes;
+            std::ifstream file(input_file);
+            readInput(file, processes);
+            mrc.max_frames = config.num_frames;
+            MissRatioCurve curve(mrc, processes);
+
+            TraceReader trace(input_file, (long)file.tellg(), decode_threads);
+            instruction_t batch[TRACE_BATCH_SIZE];
+            size_t batch_size;
+            while ((batch_size = trace.next_batch(batch, TRACE_BATCH_SIZE)) > 0) {
+                curve.run(std::span<const instruction_t>(batch, batch_size));
+            }
+            StdoutSink sink;
+            curve.print(&sink);
+        }
+        catch (const std::exception& e) {
+            fflush(stdout);
+            std::cout << e.what() << std::endl;
+            exit(1);
+        }
+        return 0;
+    }
+
+    std::unique_ptr<Randomizer> randomizer;
+    if (config.algo == 'r') {
+        randomizer.reset(new Randomizer(rfile));
+        config.randomizer = randomizer.get();
+    }
+
+    std::ofstream delta;
+    if (!delta_file.empty()) {
+        delta.open(delta_file, std::ios::binary);
+        if (!delta) {
+            std::cout << "Cannot open " << delta_file << std::endl;
+            exit(1);
+        }
+        config.delta_trace = &delta;
+    }
+
+    try {
+        Simulator simulator(config);
+        std::ifstream file(input_file);
+        readInput(file, simulator.processes());
+
+        // Instructions start right after the process specification
+        TraceReader trace(input_file, (long)file.tellg(), decode_threads);
+        instruction_t batch[TRACE_BATCH_SIZE];
+        size_t batch_size;
+        while ((batch_size = trace.next_batch(batch, TRACE_BATCH_SIZE)) > 0) {
+            simulator.run(std::span<const instruction_t>(batch, batch_size));
+        }
+        simulator.finish();
+    }
+    catch (const std::exception& e) {
+        fflush(stdout);
+        std::cout << e.what() << std::endl;
+        exit(1);
+    }
+}
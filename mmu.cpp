@@ -1,43 +1,205 @@
 #include "mmu.h"
+#include <algorithm>
+#include <cstdarg>
+#include <stdexcept>
+
+// Used inside Simulator and pager members, which both carry options and sink
+#define output(fmt...)        do { if (options.do_show_output) sink->printf(fmt); } while(0)
+#define verbose(fmt...)        do { if (options.do_verbose) sink->printf(fmt); } while(0)
+#define a_output(fmt...)        do { if (options.a_flag) sink->printf(fmt); } while(0)
+
+
+// ========================|  Output Sinks  |=============================
+
+
+void OutputSink::printf(const char* fmt, ...) {
+    char buffer[1024];
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (length < (int)sizeof(buffer)) {
+        write(buffer, length);
+        return;
+    }
+    std::string line(length, '\0');
+    va_start(args, fmt);
+    vsnprintf(&line[0], length + 1, fmt, args);
+    va_end(args);
+    write(line.data(), length);
+}
+
+void StdoutSink::write(const char* text, size_t length) {
+    fwrite(text, 1, length, stdout);
+}
+
+
+// ========================|  Frame Mappings  |=============================
+
+
+frame_table_t::frame_table_t(int num_frames, process_arena& processes) :
+    frames(num_frames, frame_t{FRAME_FREE, 0}),
+    colds(num_frames, frame_cold_t{-1, 0, -1, {}, {}}),
+    arena(processes) {}
+
+
+// Shared frames are the exception, the common case never leaves the hot array
+bool frame_table_t::shared_referenced(const frame_t* frame) {
+    if (pte(frame).REFERENCED) return true;
+    if (!frame->shared) return false;
+    for (auto& mapping : cold(frame).shared_mappings) {
+        if (pte(mapping).REFERENCED) return true;
+    }
+    return false;
+}
+
+bool frame_table_t::modified(const frame_t* frame) {
+    if (pte(frame).MODIFIED) return true;
+    if (!frame->shared) return false;
+    for (auto& mapping : cold(frame).shared_mappings) {
+        if (pte(mapping).MODIFIED) return true;
+    }
+    return false;
+}
+
+void frame_table_t::shared_clear_referenced(const frame_t* frame) {
+    if (delta) mark(frame);
+    pte(frame).REFERENCED = 0;
+    if (!frame->shared) return;
+    for (auto& mapping : cold(frame).shared_mappings) {
+        pte(mapping).REFERENCED = 0;
+    }
+}
+
+// Make a process the primary mapper of a free frame
+void frame_table_t::map(frame_t* frame, int process_id, int vpage) {
+    if (delta) delta->mark_frame(id(frame));
+    set_owner(frame, process_id, vpage);
+    frame->shared = 0;
+}
+
+void frame_table_t::add_mapping(frame_t* frame, int process_id, int vpage) {
+    cold(frame).shared_mappings.push_back({process_id, vpage});
+    frame->shared = 1;
+}
+
+// Drop one process' mapping of a frame, returns true if the frame is now unmapped
+bool frame_table_t::remove_mapping(frame_t* frame, int process_id, int vpage) {
+    if (delta) delta->mark_frame(id(frame));
+    std::vector<frame_mapping_t>& shared_mappings = cold(frame).shared_mappings;
+    if (frame->pte == process_id * MAX_VPAGES + vpage) {
+        if (shared_mappings.empty()) {
+            set_owner(frame, FRAME_FREE);
+            return true;
+        }
+        frame_mapping_t& next = shared_mappings.back();
+        set_owner(frame, next.process_id, next.vpage);
+        shared_mappings.pop_back();
+    }
+    else {
+        for (auto it = shared_mappings.begin(); it != shared_mappings.end(); ++it) {
+            if (it->process_id == process_id && it->vpage == vpage) {
+                shared_mappings.erase(it);
+                break;
+            }
+        }
+    }
+    frame->shared = !shared_mappings.empty();
+    return false;
+}
+
+// Local replacement charges a frame to its primary mapper
+void frame_table_t::set_owner(frame_t* frame, int process_id, int vpage) {
+    if (local) {
+        if (mapped(frame)) {
+            local->process(frame->process_id()).frames.erase(id(frame));
+        }
+        if (process_id != FRAME_FREE) {
+            local->process(process_id).frames.insert(id(frame));
+        }
+    }
+    frame->pte = process_id == FRAME_FREE ? FRAME_FREE : process_id * MAX_VPAGES + vpage;
+}
+
+void frame_table_t::mark(const frame_t* frame) {
+    if (delta == nullptr) return;
+    delta->mark_frame(id(frame));
+    if (!mapped(frame)) return;
+    delta->mark_page(frame->process_id(), frame->vpage());
+    if (!frame->shared) return;
+    for (auto& mapping : cold(frame).shared_mappings) {
+        delta->mark_page(mapping.process_id, mapping.vpage);
+    }
+}
 
 
 // ===========================|  Pager  |==================================
-frame_t* FIFO::select_victim_frame(frame_t* frame_table) {
-    frame_t* victim = &frame_table[hand];
-    hand = (hand + 1) % num_frames;
-    a_output("ASELECT %d\n", victim->id);
-    return victim;
+// Keep the `count` frames with the lowest keys seen so far, in key order;
+// among equal keys the frame seen first comes first
+template <typename Key>
+static void keep_lowest(std::vector<std::pair<Key, frame_t*>>& lowest, int count, Key key, frame_t* frame) {
+    if ((int)lowest.size() == count && !(key < lowest.back().first)) {
+        return;
+    }
+    auto position = std::upper_bound(lowest.begin(), lowest.end(), key,
+            [](Key key, const std::pair<Key, frame_t*>& entry) { return key < entry.first; });
+    lowest.insert(position, {key, frame});
+    if ((int)lowest.size() > count) {
+        lowest.pop_back();
+    }
 }
 
-frame_t* Random::select_victim_frame(frame_t* frame_table) {
-    int random_number = randomizer.myrandom(num_frames);
-    frame_t* victim = &frame_table[random_number];
-    a_output("ASELECT %d\n", victim->id);
-    return victim;
+void FIFO::select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) {
+    for (int i = 0; i < count; i++) {
+        hand = first_frame(hand);
+        victims[i] = &frame_table[hand];
+        hand = (hand + 1) % num_frames;
+        a_output("ASELECT %d\n", frame_table.id(victims[i]));
+    }
 }
 
-frame_t* Clock::select_victim_frame(frame_t* frame_table) {
-    frame_t* victim = nullptr;
-    while (victim == nullptr) {
-        frame_t* frame = &frame_table[hand];
-        if (frame->mapped_pte->REFERENCED == 0) {
-            victim = frame;
+void Random::select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) {
+    for (int i = 0; i < count; i++) {
+        int frame_id;
+        if (scope < 0) {
+            frame_id = randomizer.myrandom(num_frames);
         }
         else {
-            frame->mapped_pte->REFERENCED = 0;
+            // Local selection: draw among the frames of the faulting process
+            frame_id = *std::next(scope_frames->begin(), randomizer.myrandom(scope_frames->size()));
+        }
+        // A frame drawn again gives way to the next one not taken yet
+        while (std::find(victims, victims + i, &frame_table[frame_id]) != victims + i) {
+            frame_id = next_frame(frame_id);
+        }
+        victims[i] = &frame_table[frame_id];
+        a_output("ASELECT %d\n", frame_id);
+    }
+}
+
+void Clock::select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) {
+    int found = 0;
+    while (found < count) {
+        hand = first_frame(hand);
+        frame_t* frame = &frame_table[hand];
+        // A second lap passes over the frames taken on the first one
+        bool taken = std::find(victims, victims + found, frame) != victims + found;
+        if (!taken && !frame_table.referenced(frame)) {
+            victims[found++] = frame;
+            a_output("ASELECT %d\n", hand);
+        }
+        else if (!taken) {
+            frame_table.clear_referenced(frame);
         }
         hand = (hand + 1) % num_frames;
     }
-    a_output("ASELECT %d\n", victim->id);
-    return victim;
 }
 
-frame_t* NRU::select_victim_frame(frame_t* frame_table) {
-    frame_t* victim = nullptr;
-    int class_of_victim = 0;
-    std::array<frame_t*, 4> frames_classes = {nullptr, nullptr, nullptr, nullptr};
+void NRU::select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) {
+    std::array<std::vector<frame_t*>, 4> frames_classes;
     bool do_reset_bits = false;
     int lowest_class = 0;
+    frame_t* stopped_at = nullptr;
 
     if (time_since_reset >= 48) {
         for (int i = 0; i < num_frames; i++) {
@@ -47,118 +209,120 @@ frame_t* NRU::select_victim_frame(frame_t* frame_table) {
     }
 
 
-    int traversed = 0;
+    // The periodic reset visits every frame, other scans only eligible ones
+    int traversed = num_frames;
+    int visits = do_reset_bits ? num_frames : scan_length();
+    int frame_id = do_reset_bits ? hand : first_frame(hand);
 
-    for (int i = 0; i < num_frames; i++) {
-        frame_t* frame = &frame_table[(i + hand) % num_frames];
-        traversed++;
-        if (frame->mapped_pte->REFERENCED == 0 && frame->mapped_pte->MODIFIED == 0) {
-            if (frames_classes[0] == nullptr) {
-                frames_classes[0] = frame;
-            }
-            if (!do_reset_bits) {
-                break;
-                // frame->mapped_pte->MODIFIED = 0;
+    for (int i = 0; i < visits; i++, frame_id = do_reset_bits ? (frame_id + 1 == num_frames ? 0 : frame_id + 1) : next_frame(frame_id)) {
+        frame_t* frame = &frame_table[frame_id];
+        if (scope >= 0 && frame->process_id() != scope) {
+            // The periodic reset still covers every resident page
+            if (do_reset_bits && frame_table.mapped(frame)) {
+                frame_table.clear_referenced(frame);
             }
+            continue;
         }
-        else if (frame->mapped_pte->REFERENCED == 0 && frame->mapped_pte->MODIFIED == 1) {
-            if (do_reset_bits) {
-                frame->mapped_pte->REFERENCED = 0;
-                // frame->mapped_pte->MODIFIED = 0;
-            }
-            if (frames_classes[1] == nullptr) {
-                frames_classes[1] = frame;
-            }
+        bool referenced = frame_table.referenced(frame);
+        bool modified = frame_table.modified(frame);
+        int frame_class = (referenced ? 2 : 0) + (modified ? 1 : 0);
+        if (do_reset_bits && referenced) {
+            frame_table.clear_referenced(frame);
+            // frame->mapped_pte->MODIFIED = 0;
         }
-        else if (frame->mapped_pte->REFERENCED == 1 && frame->mapped_pte->MODIFIED == 0) {
-            if (do_reset_bits) {
-                frame->mapped_pte->REFERENCED = 0;
-                // frame->mapped_pte->MODIFIED = 0;
-            }
-            if (frames_classes[2] == nullptr) {
-                frames_classes[2] = frame;
-            }
+        if ((int)frames_classes[frame_class].size() < count) {
+            frames_classes[frame_class].push_back(frame);
         }
-        else if (frame->mapped_pte->REFERENCED == 1 && frame->mapped_pte->MODIFIED == 1) {
-            if (do_reset_bits) {
-                frame->mapped_pte->REFERENCED = 0;
-                // frame->mapped_pte->MODIFIED = 0;
-            }
-            if (frames_classes[3] == nullptr) {
-                frames_classes[3] = frame;
-            }
+        // Enough class 0 frames: the rest of the scan cannot do better
+        if (frame_class == 0 && (int)frames_classes[0].size() == count && !do_reset_bits) {
+            traversed = (frame_id - hand + num_frames) % num_frames + 1;
+            stopped_at = frame;
+            break;
         }
     }
-    for (int k = 0; k < 4; k++) {
-        if (frames_classes[k] != nullptr) {
-            victim = frames_classes[k];
+    int found = 0;
+    for (int k = 3; k >= 0; k--) {
+        if (!frames_classes[k].empty()) {
             lowest_class = k;
-            break;
         }
     }
-    a_output("ASELECT: hand=%2d %d | %d %d %d\n", hand, do_reset_bits, lowest_class, victim->id, traversed);
-    hand = (victim->id + 1) % num_frames;
-
-    return victim;
+    for (int k = 0; k < 4 && found < count; k++) {
+        for (size_t j = 0; j < frames_classes[k].size() && found < count; j++) {
+            victims[found++] = frames_classes[k][j];
+        }
+    }
+    a_output("ASELECT: hand=%2d %d | %d", hand, do_reset_bits, lowest_class);
+    for (int k = 0; k < count; k++) {
+        a_output(" %d", frame_table.id(victims[k]));
+    }
+    a_output(" %d\n", traversed);
+    hand = (frame_table.id(stopped_at != nullptr ? stopped_at : victims[0]) + 1) % num_frames;
 }
 
 void NRU::update_instr_count() {
     time_since_reset++;
 }
 
-frame_t* Aging::select_victim_frame(frame_t* frame_table) {
+void NRU::skip_instructions(unsigned long count) {
+    time_since_reset += count;
+}
+
+void Aging::select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) {
     a_output("ASELECT %d-%d | ", hand, ((hand+num_frames-1)%num_frames));
     frame_t* frame = nullptr;
-    frame_t* victim = nullptr;
-    unsigned long lowest_age = 0xFFFFFFFF;
+    std::vector<std::pair<uint32_t, frame_t*>> lowest;
 
-    for (int i = 0; i < num_frames; i++) {
-        frame = &frame_table[(hand + i) % num_frames];
+    int visits = scan_length();
+    int frame_id = first_frame(hand);
+    for (int i = 0; i < visits; i++, frame_id = next_frame(frame_id)) {
+        frame = &frame_table[frame_id];
         // frame->vpage->REFERENCED? frame->age | 0x80000000 : frame->age;
 
-        frame->age = (frame->age >> 1);
-        frame->age = frame->mapped_pte->REFERENCED? (frame->age | 0x80000000) : frame->age;
-        //frame->age = (frame->age | 0x80000000);
-        a_output("%d:%lx ", frame->id, frame->age);
-        if (frame->age < lowest_age) {
-            lowest_age = frame->age;
-            victim = frame;
-        }
-        frame->mapped_pte->REFERENCED = 0;
+        uint32_t& frame_age = age[frame_table.id(frame)];
+        frame_age = (frame_age >> 1);
+        frame_age = frame_table.test_and_clear_referenced(frame)? (frame_age | 0x80000000) : frame_age;
+        //frame_age = (frame_age | 0x80000000);
+        a_output("%d:%x ", frame_table.id(frame), frame_age);
+        keep_lowest(lowest, count, frame_age, frame);
     }
-    a_output("| %d\n", victim->id);
-    hand = (victim->id+1) % num_frames;
-    return victim;
+    a_output("|");
+    for (int k = 0; k < count; k++) {
+        victims[k] = lowest[k].second;
+        a_output(" %d", frame_table.id(victims[k]));
+    }
+    a_output("\n");
+    hand = (frame_table.id(victims[0])+1) % num_frames;
 }
 
-void Aging::reset_age(frame_t* frame) {
-    frame->age = 0;
+void Aging::reset_age(int frame_id) {
+    age[frame_id] = 0;
 }
 
-frame_t* WorkingSet::select_victim_frame(frame_t* frame_table) {
+void WorkingSet::select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) {
     int orig_hand = hand;
 
-    frame_t* ref_backup = nullptr;
-    frame_t* nref_backup = nullptr;
-    frame_t* future_victim = nullptr;
-    frame_t* victim = nullptr;
-    bool found_victim = false;
-    unsigned long ref_oldest_time_last_used = 0xFFFFFFFF;
-    unsigned long nref_oldest_time_last_used = 0xFFFFFFFF;
-    unsigned long current_time = gstats.inst_count + gstats.ctx_switches + gstats.process_exits -1;
+    // Unreferenced pages older than tau in scan order, and backups
+    std::vector<frame_t*> old_frames;
+    std::vector<std::pair<unsigned long, frame_t*>> ref_backups;
+    std::vector<std::pair<unsigned long, frame_t*>> nref_backups;
+    frame_t* stopped_at = nullptr;
+    unsigned long current_time = gstats.instructions() - 1;
     // a_output("current time: %lu\n", gstats.inst_count + gstats.ctx_switches + gstats.process_exits);
     // a_output(" inst_count: %lu\n", gstats.inst_count);
     // a_output(" ctx_switches: %lu\n", gstats.ctx_switches);
     // a_output(" process_exits: %lu\n", gstats.process_exits);
     a_output("ASELECT %d-%d | ", hand, ((hand+num_frames-1)%num_frames));
 
-    while (found_victim == false) {
-        frame_t* frame = &frame_table[hand];
-        a_output("%d(%d %d:%d %lu) ", frame->id, 
-                                        frame->mapped_pte->REFERENCED, 
-                                        frame->mapped_process->process_id,
-                                        frame->mapped_vpage,
-                                        frame->last_used);
+    int visits = scan_length();
+    int frame_id = first_frame(hand);
+    for (int i = 0; i < visits; i++, frame_id = next_frame(frame_id)) {
+        frame_t* frame = &frame_table[frame_id];
+        unsigned long& frame_last_used = last_used[frame_table.id(frame)];
+        a_output("%d(%d %d:%d %lu) ", frame_table.id(frame), 
+                                        frame_table.referenced(frame), 
+                                        frame->process_id(),
+                                        frame->vpage(),
+                                        frame_last_used);
         // Keep backup victim if nothing found
         // if (frame->last_used < oldest_time_last_used) {
         //     victim = frame;
@@ -166,61 +330,54 @@ frame_t* WorkingSet::select_victim_frame(frame_t* frame_table) {
         // }
 
 
-        if (frame->mapped_pte->REFERENCED) {
-
-            if (frame->last_used < ref_oldest_time_last_used) {
-                ref_backup = frame;
-                ref_oldest_time_last_used = frame->last_used;
-            }
-            frame->last_used = current_time;
-            frame->mapped_pte->REFERENCED = 0;
+        if (frame_table.test_and_clear_referenced(frame)) {
+            keep_lowest(ref_backups, count, frame_last_used, frame);
+            frame_last_used = current_time;
         }
         else {
-            if (gstats.inst_count + gstats.ctx_switches + gstats.process_exits - frame->last_used > 50) {
-                if (victim == nullptr) {
-                    victim = frame;
-                    a_output("STOP(%d) ", (hand - orig_hand + 1 + num_frames) % num_frames);
+            if (gstats.instructions() - frame_last_used > tau) {
+                old_frames.push_back(frame);
+                if ((int)old_frames.size() == count) {
+                    a_output("STOP(%d) ", (frame_id - orig_hand + 1 + num_frames) % num_frames);
+                    stopped_at = frame;
                     break;
                 }
-                //future_victim = frame;
-                //found_victim = true;
             }
             else {
-                if (frame->last_used < nref_oldest_time_last_used) {
-                    nref_backup = frame;
-                    nref_oldest_time_last_used = frame->last_used;
-                }
+                keep_lowest(nref_backups, count, frame_last_used, frame);
             }
         }
-        hand = (hand + 1) % num_frames;
-
-        // Check if wrapped around
-        if (orig_hand == hand) {
+    }
 
-            break;
-        }
+    int found = 0;
+    for (size_t j = 0; j < old_frames.size() && found < count; j++) {
+        victims[found++] = old_frames[j];
+    }
+    for (size_t j = 0; j < nref_backups.size() && found < count; j++) {
+        victims[found++] = nref_backups[j].second;
+    }
+    for (size_t j = 0; j < ref_backups.size() && found < count; j++) {
+        victims[found++] = ref_backups[j].second;
     }
 
-    if (victim == nullptr) {
-        if (nref_backup != nullptr) {
-            victim = nref_backup;
-        }
-        else {
-            victim = ref_backup;
-        }
+    a_output("|");
+    for (int k = 0; k < count; k++) {
+        a_output(" %d", frame_table.id(victims[k]));
     }
+    a_output("\n");
+    hand = (frame_table.id(stopped_at != nullptr ? stopped_at : victims[0])+1) % num_frames;
+}
 
-    a_output("| %d\n", victim->id);
-    hand = (victim->id+1) % num_frames;
-    return victim;
+void WorkingSet::reset_age(int frame_id) {
+    last_used[frame_id] = gstats.instructions() - 1;
 }
 
 // ====================|  Diagnostic Functions  |===========================
 
 
 // Print process statistics for a single process
-void printProcessStatistics(process_object* current_process) {
-    printf("PROC[%d]: U=%lu M=%lu I=%lu O=%lu FI=%lu FO=%lu Z=%lu SV=%lu SP=%lu\n",
+void Simulator::printProcessStatistics(process_object* current_process) {
+    sink->printf("PROC[%d]: U=%lu M=%lu I=%lu O=%lu FI=%lu FO=%lu Z=%lu SV=%lu SP=%lu\n",
             current_process->process_id,
             current_process->pstats.unmaps, 
             current_process->pstats.maps, 
@@ -234,8 +391,8 @@ void printProcessStatistics(process_object* current_process) {
 }
 
 
-// Print global statistics
-void printGlobalStatistics(std::map<int, process_object> processes, global_stats &gstats) {
+// Total cost of the simulation so far
+unsigned long long Simulator::total_cost() const {
     
     // Initialize cost to 0
     unsigned long long cost = 0;
@@ -244,81 +401,108 @@ void printGlobalStatistics(std::map<int, process_object> processes, global_stats
     cost += (unsigned long long)gstats.inst_count;
     cost += (unsigned long long)gstats.ctx_switches * 130;
     cost += (unsigned long long)gstats.process_exits * 1230;
-    for (auto& [id, process] : processes) {
+    cost += (unsigned long long)gstats.forks * 1500;
+    for (int id = 0; id < arena.size(); id++) {
+        const process_object& process = arena[id];
         cost += (unsigned long long)process.pstats.maps * 350;
         cost += (unsigned long long)process.pstats.unmaps * 410;
-        cost += (unsigned long long)process.pstats.ins * 3200;
-        cost += (unsigned long long)process.pstats.outs * 2750;
         cost += (unsigned long long)process.pstats.fins * 2350;
         cost += (unsigned long long)process.pstats.fouts * 2800;
         cost += (unsigned long long)process.pstats.zeros * 150;
         cost += (unsigned long long)process.pstats.segv * 440;
         cost += (unsigned long long)process.pstats.segprot * 410;
+        cost += (unsigned long long)process.pstats.cows * 300;
     }
+    // Swap I/O: a single-page write costs 2750 and a single-page read 3200,
+    // each further page of a clustered I/O only its transfer
+    cost += (unsigned long long)swap.write_ios * 2000;
+    cost += (unsigned long long)swap.write_pages * 750;
+    cost += (unsigned long long)swap.read_ios * 2400;
+    cost += (unsigned long long)swap.read_pages * 800;
+    if (tiers) {
+        cost += (unsigned long long)gstats.slow_hits * (tiers->slow_access_cost - 1);
+        cost += (unsigned long long)(gstats.promotions + gstats.demotions) * 800;
+    }
+    return cost;
+}
 
-    // Print global statistics
-    printf("TOTALCOST %lu %lu %lu %llu %lu\n", 
-            gstats.inst_count + gstats.ctx_switches + gstats.process_exits, 
+
+// Print global statistics
+void Simulator::printGlobalStatistics() {
+    sink->printf("TOTALCOST %lu %lu %lu %llu %lu\n", 
+            gstats.instructions(), 
             gstats.ctx_switches, 
             gstats.process_exits, 
-            cost, 
+            total_cost(), 
             sizeof(pte_t));
 }
 
 
 // Print page table for a single process
-void printPageTable(process_object* current_process) {
+void Simulator::printPageTable(process_object* current_process) {
+    ::printPageTable(sink, current_process->process_id, current_process->page_table);
+}
+
+void printPageTable(OutputSink* sink, int process_id, const pte_t* page_table) {
 
     // Print page table
-    printf("PT[%d]:", current_process->process_id);
+    sink->printf("PT[%d]:", process_id);
     for (int i = 0; i < MAX_VPAGES; ++i) {
-        printf(" ");
-        pte_t& page_table_entry = current_process->page_table[i];
+        sink->printf(" ");
+        const pte_t& page_table_entry = page_table[i];
         if (!page_table_entry.PRESENT) {
             if (page_table_entry.PAGEDOUT) {
-                printf("#");
+                sink->printf("#");
             }
             else {
-                printf("*");
+                sink->printf("*");
             }
         }
         else {
-            printf("%d:", i);
-            printf("%c", page_table_entry.REFERENCED ? 'R' : '-');
-            printf("%c", page_table_entry.MODIFIED ? 'M' : '-');
-            printf("%c", page_table_entry.PAGEDOUT ? 'S' : '-');
+            sink->printf("%d:", i);
+            sink->printf("%c", page_table_entry.REFERENCED ? 'R' : '-');
+            sink->printf("%c", page_table_entry.MODIFIED ? 'M' : '-');
+            sink->printf("%c", page_table_entry.PAGEDOUT ? 'S' : '-');
         }
     }
-    printf("\n");
+    sink->printf("\n");
 }
 
 
 // Print frame table
-void printFrameTable(frame_t* frame_table, int num_frames) {
-    printf("FT:");
+void Simulator::printFrameTable() {
+    ::printFrameTable(sink, frame_table.data(), frame_table.size(), num_frames);
+}
+
+void printFrameTable(OutputSink* sink, const frame_t* frames, int size, int num_frames) {
+    sink->printf("FT:");
 
-    for (int i = 0; i < num_frames; ++i) {
-        printf(" ");
-        frame_t& frame = frame_table[i];
-        if (frame.mapped_pte == nullptr) {
-            printf("*");
+    for (int i = 0; i < size; ++i) {
+        if (i == num_frames) {
+            sink->printf(" |");
+        }
+        sink->printf(" ");
+        const frame_t& frame = frames[i];
+        if (frame.pte == FRAME_FREE) {
+            sink->printf("*");
         }
         else {
-            printf("%d:%d", frame.mapped_process->process_id, frame.mapped_vpage);
+            sink->printf("%d:%d", frame.process_id(), frame.vpage());
         }
     }
-    printf("\n");
+    sink->printf("\n");
 }
 
 
 // Print processes
-void printProcesses(std::map<int, process_object> processes) {
-    for (auto& [id, process] : processes) {
-        verbose("Process %d VMA:\n", id);
-        for (auto it = process.VMA_list.begin(); it != process.VMA_list.end(); ++it) {
-            auto& [start_vpage, end_vpage, write_protected, id, file_mapped] = *it;
-            int index = std::distance(process.VMA_list.begin(), it);
-            verbose("  VMA %d: %d %d %d %d\n", index, start_vpage, end_vpage, write_protected, file_mapped);
+void printProcesses(process_arena &processes, OutputSink* sink, const simulator_options& options) {
+    for (int pid = 0; pid < processes.size(); pid++) {
+        process_object& process = processes[pid];
+        verbose("Process %d VMA:\n", pid);
+        for (VMA* it = process.VMA_list; it != process.VMA_list + process.number_of_VMA; ++it) {
+            auto& [start_vpage, end_vpage, write_protected, id, file_mapped, file_id] = *it;
+            int index = it - process.VMA_list;
+            verbose("  VMA %d: %d %d %d %d %d\n", index, start_vpage, end_vpage, write_protected, file_mapped, file_id);
         }
     }
 }
@@ -328,7 +512,7 @@ void printProcesses(std::map<int, process_object> processes) {
 
 
 // Read info-containing line from a file
-std::string readLine(std::ifstream& file) {
+std::string readLine(std::istream& file) {
 
     std::string line;
 
@@ -344,68 +528,115 @@ std::string readLine(std::ifstream& file) {
 }
 
 
-// Parse input from file
-std::map<int, process_object> readInput(std::ifstream& file){
+// Parse input from file, the processes are appended to the arena
+void readInput(std::istream& file, process_arena &processes){
     std::string line;
-    std::map<int, process_object> processes;
     int num_processes = 0;
+    std::vector<int> first_vma;
     
     num_processes = std::stoi(readLine(file));
 
-    // Check for vma per process in array of processes
-    //process_object* processes = new process_object[num_processes];
+    // Processes already in the arena keep their slices, which move with the
+    // flat array when it grows
+    int first_id = processes.size();
+    std::vector<long> slices;
+    for (int id = 0; id < first_id; id++) {
+        const VMA* list = processes[id].VMA_list;
+        slices.push_back(list != nullptr ? list - processes.vmas.data() : -1);
+    }
+
+    // VMAs of all processes go into the arena's flat array
     for (int i = 0; i < num_processes; i++) {
         int num_vma = std::stoi(readLine(file));
-        std::vector<VMA> vma_list;
+        first_vma.push_back(processes.vmas.size());
 
         for (int j = 0; j < num_vma; j++) {
             std::string line = readLine(file);
             std::istringstream iss(line);
             int start_vpage, end_vpage, write_protected;
+            int file_id = -1;
             bool file_mapped;
             iss >> start_vpage >> end_vpage >> write_protected >> file_mapped;
-            vma_list.push_back(VMA(start_vpage, end_vpage, write_protected, j, file_mapped));
+            // Optional fifth column names the mapped file so its pages can be shared
+            if (!(iss >> file_id) || !file_mapped) {
+                file_id = -1;
+            }
+            processes.vmas.push_back(VMA(start_vpage, end_vpage, write_protected, j, file_mapped, file_id));
         }
-        processes[i] = process_object(vma_list);
-        processes[i].process_id = i;
+        processes.add().number_of_VMA = num_vma;
+    }
+    // The flat array is complete, hand out the slices
+    for (int id = 0; id < first_id; id++) {
+        if (slices[id] >= 0) {
+            processes[id].VMA_list = processes.vmas.data() + slices[id];
+        }
+    }
+    for (int i = 0; i < num_processes; i++) {
+        processes[first_id + i].VMA_list = processes.vmas.data() + first_vma[i];
     }
-    return processes;
 }
 
-// Popule the frame table
-void populate_frame_table(int num_frames, std::deque<int> &free_list, frame_t* frame_table) {
-    for (int i = 0; i < num_frames; i++) {
-        free_list.push_back(i);
-        frame_table[i].id = i;
-        frame_table[i].mapped_pte = nullptr;
-        frame_table[i].mapped_process = nullptr;
-        frame_table[i].mapped_vpage = 0;
-        frame_table[i].mapped_vma_id = 0;
-        frame_table[i].age = 0;
+
+process_arena::process_arena(const process_arena& other) : count(0) {
+    *this = other;
+}
+
+process_arena& process_arena::operator=(const process_arena& other) {
+    if (this == &other) {
+        return *this;
+    }
+    vmas = other.vmas;
+    chunks.clear();
+    page_tables.clear();
+    count = 0;
+    for (int id = 0; id < other.size(); id++) {
+        process_object& process = add();
+        pte_t* page_table = process.page_table;
+        process = other[id];
+        process.page_table = page_table;
+        // Same slice, in this arena's VMA array
+        if (process.VMA_list != nullptr) {
+            process.VMA_list = vmas.data() + (other[id].VMA_list - other.vmas.data());
+        }
     }
+    std::copy(other.page_tables.begin(), other.page_tables.end(), page_tables.begin());
+    return *this;
 }
 
+process_object& process_arena::add() {
+    if (count % CHUNK_SIZE == 0) {
+        chunks.emplace_back(new process_object[CHUNK_SIZE]);
+    }
+    // Growing the page tables may move them: point every process at its new slice
+    const pte_t* old_tables = page_tables.data();
+    page_tables.resize((size_t)(count + 1) * MAX_VPAGES, pte_t{});
+    if (page_tables.data() != old_tables) {
+        for (int id = 0; id < count; id++) {
+            (*this)[id].page_table = page_tables.data() + (size_t)id * MAX_VPAGES;
+        }
+    }
+    process_object& process = (*this)[count];
+    process.page_table = page_tables.data() + (size_t)count * MAX_VPAGES;
+    process.process_id = count++;
+    return process;
+}
 
 // ====================|  Simulation Helper Functions  |===========================
 
 
-// Get next instruction from file
-bool get_next_instruction(char* operation, int* vpage, std::ifstream& file) {
-    std::string line;
-    line =  readLine(file);
-    if (line.empty()) {
-        return false;
-    }
-    else {
-        std::istringstream iss(line);  
-        iss >> *operation >> *vpage;
-        return true;
+// Find the VMA containing a virtual page, nullptr if the page is not mapped
+VMA* find_vma(process_object* process, int vpage) {
+    for (VMA* it = process->VMA_list; it != process->VMA_list + process->number_of_VMA; ++it) {
+        if (vpage >= it->start_vpage && vpage <= it->end_vpage) {
+            return it;
+        }
     }
+    return nullptr;
 }
 
 
 // Allocate a frame from the free list
-frame_t* allocate_frame_from_free_list(std::deque<int> &free_list, frame_t* frame_table) {
+frame_t* Simulator::allocate_frame_from_free_list() {
 
     if (free_list.empty()) {
         return nullptr;
@@ -419,71 +650,180 @@ frame_t* allocate_frame_from_free_list(std::deque<int> &free_list, frame_t* fram
 }
 
 
-frame_t* get_frame(pagerClass* pager, std::deque<int> &free_list, frame_t* frame_table) {
+// Unmap every PTE that maps a frame, the page is written back at most once
+void Simulator::evict_frame(frame_t* frame) {
+    frame_table.mark(frame);
+    frame_cold_t& cold = frame_table.cold(frame);
+    process_object& owner = frame_table.process(frame);
+    process_object* dirty_process = nullptr;
+    output(" UNMAP %d:%d\n", frame->process_id(), frame->vpage());
+    owner.pstats.unmaps++;
+    if (frame_table.pte(frame).MODIFIED) dirty_process = &owner;
+    for (auto& mapping : cold.shared_mappings) {
+        output(" UNMAP %d:%d\n", mapping.process_id, mapping.vpage);
+        arena[mapping.process_id].pstats.unmaps++;
+        if (dirty_process == nullptr && frame_table.pte(mapping).MODIFIED) dirty_process = &arena[mapping.process_id];
+    }
 
-    frame_t* frame = allocate_frame_from_free_list(free_list, frame_table);
-    if (frame == nullptr) frame = pager->select_victim_frame(frame_table);
-    if (frame->mapped_pte != nullptr){
-        pte_t* old_pte = frame->mapped_pte;
-        output(" UNMAP %d:%d\n", frame->mapped_process->process_id, frame->mapped_vpage);
-        frame->mapped_process->pstats.unmaps++;
-        if (old_pte->MODIFIED){
-            if (frame->mapped_process->VMA_list[frame->mapped_vma_id].file_mapped) {
-                output(" FOUT\n");
-                frame->mapped_process->pstats.fouts++;
-                old_pte->PAGEDOUT = 0;
-                old_pte->MODIFIED = 0;
-            }
-            else {
-                output(" OUT\n");
-                frame->mapped_process->pstats.outs++;
-                old_pte->PAGEDOUT = 1;
-                old_pte->MODIFIED = 0;
+    // All mappers share the VMA layout of the owner (same file or same fork)
+    bool file_mapped = find_vma(&owner, frame->vpage())->file_mapped;
+    if (dirty_process != nullptr) {
+        if (file_mapped) {
+            output(" FOUT\n");
+            dirty_process->pstats.fouts++;
+        }
+        else {
+            output(" OUT\n");
+            dirty_process->pstats.outs++;
+        }
+    }
 
-            }
-        } 
-    
-        old_pte->PRESENT = 0;
-        // old_pte->REFERENCED = 0;
-        // old_pte->MODIFIED = 0;
-        // old_pte->WRITE_PROTECT = 0;
-        // old_pte->PHYSICAL_FRAME_NUMBER = 0;
+    // A dirty page gets a new slot, a clean one keeps the copy it was read from
+    int slot = cold.swap_slot;
+    if (dirty_process != nullptr && !file_mapped) {
+        slot = swap_write();
+    }
+    resolve_slot_waiters(frame, slot);
+
+    cold.shared_mappings.push_back({frame->process_id(), frame->vpage()});
+    for (auto& mapping : cold.shared_mappings) {
+        pte_t& old_pte = frame_table.pte(mapping);
+        if (dirty_process != nullptr) {
+            old_pte.PAGEDOUT = file_mapped ? 0 : 1;
+            old_pte.MODIFIED = 0;
+        }
+        old_pte.PRESENT = 0;
+        if (old_pte.PAGEDOUT) {
+            set_swap_slot(old_pte, slot);
+        }
+        // old_pte.REFERENCED = 0;
+        // old_pte.WRITE_PROTECT = 0;
+        // old_pte.PHYSICAL_FRAME_NUMBER = 0;
     }
-    frame->mapped_pte = nullptr;
+    cold.shared_mappings.clear();
+    uncache_frame(frame);
+    drop_frame_slot(frame);
+    frame_table.set_owner(frame, FRAME_FREE);
+    frame->shared = 0;
+}
+
+
+// Return an unmapped frame to the free list of its tier
+void Simulator::release_frame(frame_t* frame) {
+    drop_frame_slot(frame);
+    int frame_id = frame_table.id(frame);
+    if (frame_id >= num_frames) {
+        tiers->free_list.push_back(frame_id);
+    }
+    else {
+        free_list.push_back(frame_id);
+    }
+}
+
+
+// Drop the page cache entry of a frame that no longer holds the cached page
+void Simulator::uncache_frame(frame_t* frame) {
+    frame_cold_t& cold = frame_table.cold(frame);
+    if (cold.file_id >= 0) {
+        page_cache.erase({cold.file_id, cold.file_offset});
+        cold.file_id = -1;
+    }
+}
+
+
+frame_t* Simulator::get_frame(process_object* process) {
+
+    frame_t* frame = nullptr;
+    if (local_replacement) {
+        frame = allocate_local_frame(process);
+    }
+    else {
+        frame = allocate_frame_from_free_list();
+        if (frame == nullptr) frame = reclaim_frames();
+    }
+    if (frame_table.mapped(frame)){
+        if (tiers) {
+            demote_frame(frame);
+        }
+        else {
+            evict_frame(frame);
+        }
+    }
+    flush_swap_writes();
     return frame;
 }
 
+
+// The free list is empty: take the pager's victim and, with swap clustering,
+// up to cluster - 1 more victims of the same scope from the same scan, so
+// that their dirty pages go out as one write. The extra frames go to the
+// free list.
+frame_t* Simulator::reclaim_frames() {
+    if (swap.cluster == 1 || tiers) {
+        return pager->select_victim_frame(frame_table);
+    }
+    std::vector<frame_t*> batch(std::min(swap.cluster, pager->scan_length()));
+    pager->select_victim_frames(frame_table, batch.data(), batch.size());
+    for (frame_t* frame : batch) {
+        evict_frame(frame);
+    }
+    for (size_t i = 1; i < batch.size(); i++) {
+        release_frame(batch[i]);
+    }
+    return batch[0];
+}
+
 // Page fault handler
-bool pagefault_handler(process_object* process,
-                        int vpage, 
-                        pagerClass *pager, 
-                        std::deque<int> &free_list,
-                        frame_t* frame_table,
-                        global_stats &gstats){
+bool Simulator::pagefault_handler(process_object* process, int vpage) {
 
     bool vpage_in_vma = false;
     VMA* vma_of_vpage = nullptr;
-    for (auto it = process->VMA_list.begin(); it != process->VMA_list.end(); ++it) {
+    for (VMA* it = process->VMA_list; it != process->VMA_list + process->number_of_VMA; ++it) {
         if (vpage >= it->start_vpage && vpage <= it->end_vpage) {
-            vma_of_vpage = &(*it);
+            vma_of_vpage = it;
             vpage_in_vma = true;
             break;
         }
     }
     if (vma_of_vpage == nullptr) {
         process->pstats.segv++;
-        printf(" SEGV\n");
+        sink->printf(" SEGV\n");
         return false;
     }
 
-    frame_t* allocated_frame = get_frame(pager, free_list, frame_table);
-    process->page_table[vpage].PHYSICAL_FRAME_NUMBER = allocated_frame->id;
+    // Page already cached for another mapper of the same file: share its frame
+    if (vma_of_vpage->file_id >= 0) {
+        auto cached = page_cache.find({vma_of_vpage->file_id, vpage - vma_of_vpage->start_vpage});
+        if (cached != page_cache.end()) {
+            process->page_table[vpage].PHYSICAL_FRAME_NUMBER = cached->second;
+            process->page_table[vpage].WRITE_PROTECT = vma_of_vpage->write_protected;
+            process->page_table[vpage].PRESENT = 1;
+            frame_table.add_mapping(&frame_table[cached->second], process->process_id, vpage);
+            gstats.cache_hits++;
+            output(" MAP %d\n", cached->second);
+            process->pstats.maps++;
+            return true;
+        }
+    }
+
+    frame_t* allocated_frame = get_frame(process);
+    int frame_id = frame_table.id(allocated_frame);
+    // The swap slot of a paged-out page is read before the PTE points at the frame
+    int slot = NO_SWAP_SLOT;
+    if (!vma_of_vpage->file_mapped && process->page_table[vpage].PAGEDOUT) {
+        slot = process->page_table[vpage].PHYSICAL_FRAME_NUMBER;
+        if (slot == NO_SWAP_SLOT) cancel_slot_wait(process->process_id, vpage);
+    }
+    process->page_table[vpage].PHYSICAL_FRAME_NUMBER = frame_id;
     process->page_table[vpage].WRITE_PROTECT = vma_of_vpage->write_protected;
     process->page_table[vpage].PRESENT = 1;
-    allocated_frame->mapped_pte = &(process->page_table[vpage]);
-    allocated_frame->mapped_process = process;
-    allocated_frame->mapped_vpage = vpage;
-    allocated_frame->mapped_vma_id = vma_of_vpage->id;
+    frame_table.map(allocated_frame, process->process_id, vpage);
+    if (vma_of_vpage->file_id >= 0) {
+        frame_cold_t& cold = frame_table.cold(allocated_frame);
+        cold.file_id = vma_of_vpage->file_id;
+        cold.file_offset = vpage - vma_of_vpage->start_vpage;
+        page_cache[{cold.file_id, cold.file_offset}] = frame_id;
+    }
     
     if (vma_of_vpage->file_mapped == true) {
         output(" FIN\n");
@@ -492,244 +832,1201 @@ bool pagefault_handler(process_object* process,
     else if (process->page_table[vpage].PAGEDOUT) {
         output(" IN\n");
         process->pstats.ins++;
+        swap_read(slot);
+        // The PTE's reference on the slot moves to the frame: while the page
+        // stays clean, evicting it needs no write
+        if (slot != NO_SWAP_SLOT) {
+            frame_table.cold(allocated_frame).swap_slot = slot;
+            swap.resident[slot]++;
+        }
     }
     else {
         output(" ZERO\n");
         process->pstats.zeros++;
     }
 
-    output(" MAP %d\n", allocated_frame->id);
-    pager->reset_age(allocated_frame);
-    allocated_frame->last_used = gstats.inst_count + gstats.ctx_switches + gstats.process_exits -1;
+    output(" MAP %d\n", frame_id);
+    pager->reset_age(frame_id);
 
     process->pstats.maps++;
 
     return true;
-};
+}
 
 
-// ====================|  Simulation  |===========================
+// Copy-on-write fault: give the writer a private copy of a frame shared since a fork
+void Simulator::cow_fault_handler(process_object* process, int vpage) {
 
+    pte_t* pte = &process->page_table[vpage];
+    frame_t* shared_frame = &frame_table[pte->PHYSICAL_FRAME_NUMBER];
+    pte->COPY_ON_WRITE = 0;
 
-// Simulation
-void simulation(int num_frames, std::map<int, process_object> processes, std::ifstream& file, pagerClass* pager, global_stats &gstats) {
-    
-    frame_t frame_table[num_frames];
-    std::deque<int> free_list;
-    char operation;
-    int vpage;
-    process_object* current_process;
-    pte_t* pte;	
-    int instruction_number = 0;
-
-    populate_frame_table(num_frames, free_list, frame_table);
-
-
-    while (get_next_instruction(&operation, &vpage, file)) {
-        pager->update_instr_count();
-        output("%d: ==> %c %d\n", instruction_number, operation, vpage);
-        if (operation == 'c') {
-            current_process = &processes[vpage];
-            gstats.ctx_switches++;
-        }
-        else if (operation == 'e') {
-            printf("EXIT current process %d\n", current_process->process_id);
-            gstats.process_exits++;
-            for (int i = 0; i < MAX_VPAGES; i++) {
-                if (current_process->page_table[i].PRESENT) {
-                    output(" UNMAP %d:%d\n", current_process->process_id, i);
-                    current_process->pstats.unmaps++;
-                    for (auto& frame_table_entry : frame_table) {
-                        if (frame_table_entry.mapped_process == current_process && frame_table_entry.mapped_vpage == i) {
-                            frame_table_entry.mapped_pte = nullptr;
-                            break;
-                        }
-                    }
-                    if (current_process->page_table[i].MODIFIED) {
-                        bool vpage_in_vma = false;
-                        VMA* vma_of_vpage = nullptr;
-                        for (auto it = current_process->VMA_list.begin(); it != current_process->VMA_list.end(); ++it) {
-                            if (i >= it->start_vpage && i <= it->end_vpage) {
-                                vma_of_vpage = &(*it);
-                                vpage_in_vma = true;
-                                break;
-                            }
-                        }
-                        if (vma_of_vpage->file_mapped == true) {
-                            output(" FOUT\n");
-                            current_process->pstats.fouts++;
-                        }
-                    }
-                    free_list.push_back(current_process->page_table[i].PHYSICAL_FRAME_NUMBER);
-                }
-                current_process->page_table[i].PRESENT = 0;
-                current_process->page_table[i].REFERENCED = 0;
-                current_process->page_table[i].MODIFIED = 0;
-                current_process->page_table[i].WRITE_PROTECT = 0;
-                current_process->page_table[i].PAGEDOUT = 0;
-                current_process->page_table[i].PHYSICAL_FRAME_NUMBER = 0;
+    // Sole remaining mapper keeps the frame, nothing to copy
+    if (frame_table.remove_mapping(shared_frame, process->process_id, vpage)) {
+        // Former mappers waiting for a slot get the page before it changes
+        if (!frame_table.cold(shared_frame).slot_waiters.empty()) {
+            output(" OUT\n");
+            process->pstats.outs++;
+            resolve_slot_waiters(shared_frame, swap_write());
+            flush_swap_writes();
+        }
+        frame_table.map(shared_frame, process->process_id, vpage);
+        return;
+    }
+
+    pte->PRESENT = 0;
+    frame_t* allocated_frame = get_frame(process);
+    int frame_id = frame_table.id(allocated_frame);
+    pte->PHYSICAL_FRAME_NUMBER = frame_id;
+    pte->PRESENT = 1;
+    frame_table.map(allocated_frame, process->process_id, vpage);
+
+    output(" COW\n");
+    process->pstats.cows++;
+    output(" MAP %d\n", frame_id);
+    pager->reset_age(frame_id);
+    process->pstats.maps++;
+}
+
+
+// Fork: the child gets a copy of the parent's VMAs and page table, resident frames are shared
+void Simulator::fork_process(process_object* parent, int child_id) {
+
+    // Process ids stay dense: the child takes the next free id, or the id
+    // load control reserved for it when the fork was deferred
+    bool reserved = load_control && child_id < arena.size() && working_set(child_id).reserved;
+    if (child_id != arena.size() && !reserved) {
+        throw std::runtime_error("Invalid fork: expected process " + std::to_string(arena.size()));
+    }
+    process_object& child = reserved ? arena[child_id] : arena.add();
+    if (reserved) {
+        working_set(child_id).reserved = false;
+    }
+    child.number_of_VMA = parent->number_of_VMA;
+    child.VMA_list = parent->VMA_list;
+    if (delta) {
+        delta->mark_process(parent->process_id);
+        delta->mark_process(child.process_id);
+    }
+
+    for (int i = 0; i < MAX_VPAGES; i++) {
+        pte_t& parent_pte = parent->page_table[i];
+        pte_t& child_pte = child.page_table[i];
+        // Non-resident pages keep their PAGEDOUT state and share the swapped copy
+        child_pte = parent_pte;
+        child_pte.REFERENCED = 0;
+        if (!parent_pte.PRESENT) {
+            if (parent_pte.PAGEDOUT && parent_pte.PHYSICAL_FRAME_NUMBER != NO_SWAP_SLOT) {
+                swap.refs[parent_pte.PHYSICAL_FRAME_NUMBER]++;
             }
-            
-        }
-        else if (operation == 'r' || operation == 'w') {
-            gstats.inst_count++;
-            pte = &current_process->page_table[vpage];
-            if (!pte->PRESENT) {
-                if (!pagefault_handler(current_process, vpage, pager, free_list, frame_table, gstats)){
-                    instruction_number++;
-                    continue;
+            else if (parent_pte.PAGEDOUT) {
+                // The child waits for the same frame to be written
+                auto wait = slot_waits.find(parent->process_id * MAX_VPAGES + i);
+                if (wait != slot_waits.end()) {
+                    wait_for_slot(&frame_table[wait->second], child.process_id, i);
                 }
             }
+            continue;
+        }
+        frame_t* frame = &frame_table[parent_pte.PHYSICAL_FRAME_NUMBER];
+        VMA* vma = find_vma(parent, i);
+        frame_table.add_mapping(frame, child.process_id, i);
+        // File-mapped pages stay shared, anonymous pages are copied on the first write
+        if (!vma->file_mapped) {
+            parent_pte.COPY_ON_WRITE = 1;
+            child_pte.COPY_ON_WRITE = 1;
+            gstats.cow_shared_pages++;
+        }
+    }
+}
 
-            if (operation == 'r') {
-                current_process->page_table[vpage].REFERENCED = 1;
+
+// ====================|  Simulation  |===========================
+
+
+// Frame numbers of both tiers have to fit the PTE
+static int checked_frame_count(int num_frames, int slow_frames) {
+    if (num_frames < 1 || slow_frames < 0 || (long)num_frames + slow_frames > MAX_FRAMES) {
+        throw std::invalid_argument("Invalid number of frames");
+    }
+    return num_frames + slow_frames;
+}
+
+
+// LEB128, the integers of the delta trace
+static void put_varint(std::string& buffer, uint64_t value) {
+    while (value >= 0x80) {
+        buffer.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    buffer.push_back((char)value);
+}
+
+
+Simulator::Simulator(const simulator_config& config, OutputSink* output_sink) :
+    options(config.options),
+    sink(output_sink ? output_sink : &stdout_sink),
+    num_frames(config.num_frames),
+    frame_table(checked_frame_count(config.num_frames, config.slow_frames), arena),
+    current_process(nullptr),
+    instruction_number(0),
+    fast_forward(false) {
+
+    switch (config.algo) {
+        case 'f':
+            pager.reset(new FIFO(num_frames));
+            break;
+        case 'r':
+            if (config.randomizer == nullptr) {
+                throw std::invalid_argument("Random pager needs a randomizer");
             }
+            pager.reset(new Random(num_frames, *config.randomizer));
+            break;
+        case 'c':
+            pager.reset(new Clock(num_frames));
+            break;
+        case 'e':
+            pager.reset(new NRU(num_frames));
+            break;
+        case 'a':
+            pager.reset(new Aging(num_frames));
+            break;
+        case 'w':
+            pager.reset(new WorkingSet(num_frames, gstats, config.tau));
+            break;
+        default:
+            throw std::invalid_argument("Invalid algorithm");
+    }
+    pager->options = options;
+    pager->sink = sink;
+
+    if (config.swap_cluster < 1) {
+        throw std::invalid_argument("Invalid swap cluster size");
+    }
+    swap.cluster = config.swap_cluster;
+
+    if (config.delta_trace) {
+        delta.reset(new delta_trace_t());
+        delta->out = config.delta_trace;
+        delta->frame_dirty.assign(frame_table.size(), 0);
+        delta->frames.assign(frame_table.size(), frame_t{FRAME_FREE, 0});
+        frame_table.delta = delta.get();
+        delta->buffer = DELTA_MAGIC;
+        delta->buffer.push_back(DELTA_VERSION);
+        put_varint(delta->buffer, num_frames);
+        put_varint(delta->buffer, config.slow_frames);
+        delta->out->write(delta->buffer.data(), delta->buffer.size());
+        delta->buffer.clear();
+    }
+
+    if (config.load_control && config.local_replacement) {
+        throw std::invalid_argument("Load control and local replacement are exclusive");
+    }
+    if (config.local_replacement) {
+        if (config.pff_lower < 0 || config.pff_upper <= config.pff_lower) {
+            throw std::invalid_argument("Invalid page fault frequency bounds");
+        }
+        local_replacement.reset(new local_replacement_t());
+        local_replacement->lower = config.pff_lower;
+        local_replacement->upper = config.pff_upper;
+        frame_table.local = local_replacement.get();
+    }
+    if (config.slow_frames > 0) {
+        if (config.local_replacement) {
+            throw std::invalid_argument("Memory tiers and local replacement are exclusive");
+        }
+        tiers.reset(new memory_tiers_t());
+        tiers->slow_frames = config.slow_frames;
+        tiers->slow_access_cost = config.slow_access_cost;
+        tiers->age.assign(config.slow_frames, 0);
+        for (int i = 0; i < config.slow_frames; i++) {
+            tiers->free_list.push_back(num_frames + i);
+        }
+    }
+    if (config.load_control) {
+        if (config.algo != 'w') {
+            throw std::invalid_argument("Load control requires the Working Set pager");
+        }
+        load_control.reset(new load_control_t());
+        load_control->tau = config.tau;
+    }
 
-            if (operation == 'w') {
-                if (current_process->page_table[vpage].WRITE_PROTECT == 1) {
-                    std::cout << " SEGPROT" << std::endl;
-                    current_process->pstats.segprot++;
-                    current_process->page_table[vpage].REFERENCED = 1;
+    // Hits can only be collapsed when nothing is printed per instruction
+    fast_forward = !options.do_show_output && !options.x_flag && !options.y_flag && !options.f_flag && !load_control && !delta;
+
+    // Popule the free list
+    for (int i = 0; i < num_frames; i++) {
+        free_list.push_back(i);
+    }
+}
+
+// Start from a copy of a parsed spec, which stays untouched
+Simulator::Simulator(const simulator_config& config, const process_arena& spec, OutputSink* output_sink) :
+    Simulator(config, output_sink) {
+    arena = spec;
+}
+
+Simulator::~Simulator() {}
+
+
+// Process exit: unmap every page, file-mapped dirty pages are written back
+void Simulator::exit_process(process_object* process) {
+    if (delta) delta->mark_process(process->process_id);
+    for (int i = 0; i < MAX_VPAGES; i++) {
+        if (process->page_table[i].PRESENT) {
+            output(" UNMAP %d:%d\n", process->process_id, i);
+            process->pstats.unmaps++;
+            frame_t* frame = &frame_table[process->page_table[i].PHYSICAL_FRAME_NUMBER];
+            frame_table.mark(frame);
+            bool frame_released = frame_table.remove_mapping(frame, process->process_id, i);
+            if (!frame_released && process->page_table[i].MODIFIED) {
+                // Remaining mappers inherit the dirty page, written back when it leaves the cache
+                frame_table.pte(frame).MODIFIED = 1;
+            }
+            else if (process->page_table[i].MODIFIED) {
+                VMA* vma_of_vpage = find_vma(process, i);
+                if (vma_of_vpage->file_mapped == true) {
+                    output(" FOUT\n");
+                    process->pstats.fouts++;
                 }
-                else {
-                    current_process->page_table[vpage].REFERENCED = 1;
-                    current_process->page_table[vpage].MODIFIED = 1;
+            }
+            if (frame_released && !frame_table.cold(frame).slot_waiters.empty()) {
+                // Former mappers still need the page, a dirty one is written for them
+                int slot = frame_table.cold(frame).swap_slot;
+                if (process->page_table[i].MODIFIED) {
+                    output(" OUT\n");
+                    process->pstats.outs++;
+                    slot = swap_write();
                 }
+                resolve_slot_waiters(frame, slot);
+            }
+            if (frame_released) {
+                uncache_frame(frame);
+                release_frame(frame);
+            }
+        }
+        else if (process->page_table[i].PAGEDOUT && process->page_table[i].PHYSICAL_FRAME_NUMBER != NO_SWAP_SLOT) {
+            drop_swap_slot(process->page_table[i].PHYSICAL_FRAME_NUMBER);
+        }
+        else if (process->page_table[i].PAGEDOUT) {
+            cancel_slot_wait(process->process_id, i);
+        }
+        process->page_table[i].PRESENT = 0;
+        process->page_table[i].REFERENCED = 0;
+        process->page_table[i].MODIFIED = 0;
+        process->page_table[i].WRITE_PROTECT = 0;
+        process->page_table[i].PAGEDOUT = 0;
+        process->page_table[i].COPY_ON_WRITE = 0;
+        process->page_table[i].PHYSICAL_FRAME_NUMBER = 0;
+    }
+    flush_swap_writes();
+}
+
+
+// Execute a single trace instruction
+void Simulator::step(const instruction_t& instruction) {
+    if (!load_control) {
+        execute(instruction);
+    }
+    else if (instruction.op == 'c') {
+        load_control_switch(instruction);
+    }
+    else if (load_control->deferring >= 0) {
+        // Rest of a suspended process' slice, a fork reserves the child's id now
+        if (instruction.op == 'f' && instruction.arg == arena.size()) {
+            arena.add();
+            working_set_t& child = working_set(instruction.arg);
+            child.reserved = true;
+            child.suspended = true;
+            load_control->suspended.push_back(instruction.arg);
+        }
+        working_set(load_control->deferring).deferred.push_back(instruction);
+    }
+    else {
+        execute(instruction);
+    }
+}
+
+
+void Simulator::execute(const instruction_t& instruction) {
+    execute_instruction(instruction);
+    if (delta) {
+        record_delta();
+    }
+}
+
+
+void Simulator::execute_instruction(const instruction_t& instruction) {
+    char operation = instruction.op;
+    int vpage = instruction.arg;
+
+    if (tiers && gstats.instructions() >= tiers->next_scan) {
+        scan_slow_tier();
+    }
+    pager->update_instr_count();
+    output("%d: ==> %c %d\n", instruction_number, operation, vpage);
+    instruction_number++;
+    if (load_control && load_control->total > num_frames) {
+        load_control->thrash_time++;
+    }
+
+    if (operation != 'c' && current_process == nullptr &&
+            (operation == 'e' || operation == 'f' || operation == 'r' || operation == 'w')) {
+        throw std::runtime_error("No current process");
+    }
+    if ((operation == 'r' || operation == 'w') && (unsigned)vpage >= MAX_VPAGES) {
+        throw std::runtime_error("Invalid virtual page " + std::to_string(vpage));
+    }
+
+    if (operation == 'c') {
+        current_process = arena.find(vpage);
+        if (current_process == nullptr) {
+            throw std::runtime_error("Invalid process " + std::to_string(vpage));
+        }
+        gstats.ctx_switches++;
+    }
+    else if (operation == 'f') {
+        gstats.forks++;
+        fork_process(current_process, vpage);
+    }
+    else if (operation == 'e') {
+        sink->printf("EXIT current process %d\n", current_process->process_id);
+        gstats.process_exits++;
+        exit_process(current_process);
+        if (load_control) {
+            working_set_t& ws = working_set(current_process->process_id);
+            load_control->total -= ws.size;
+            ws.size = 0;
+            ws.exited = true;
+        }
+    }
+    else if (operation == 'r' || operation == 'w') {
+        gstats.inst_count++;
+        if (load_control) {
+            working_set_t& ws = working_set(current_process->process_id);
+            ws.last_ref[vpage] = ++ws.vtime;
+        }
+        if (local_replacement) {
+            pff_quota(current_process->process_id).vtime++;
+        }
+        pte_t* pte = &current_process->page_table[vpage];
+        if (delta) delta->mark_page(current_process->process_id, vpage);
+        if (!pte->PRESENT) {
+            if (!pagefault_handler(current_process, vpage)){
+                return;
             }
+        }
+        else if (tiers) {
+            if ((int)pte->PHYSICAL_FRAME_NUMBER < num_frames) gstats.fast_hits++;
+            else gstats.slow_hits++;
+        }
+
+        if (operation == 'r') {
+            pte->REFERENCED = 1;
+        }
 
-            if (x_flag) {
-                printPageTable(current_process);
+        if (operation == 'w') {
+            if (pte->WRITE_PROTECT == 1) {
+                sink->printf(" SEGPROT\n");
+                current_process->pstats.segprot++;
+                pte->REFERENCED = 1;
             }
-            if (y_flag) {
-                for (auto& [id, process] : processes) {
-                    printPageTable(&process);
+            else {
+                if (pte->COPY_ON_WRITE) {
+                    cow_fault_handler(current_process, vpage);
                 }
+                pte->REFERENCED = 1;
+                pte->MODIFIED = 1;
+            }
+        }
+
+        if (options.x_flag) {
+            printPageTable(current_process);
+        }
+        if (options.y_flag) {
+            for (int id = 0; id < arena.size(); id++) {
+                printPageTable(&arena[id]);
             }
-            if (f_flag) {
-                printFrameTable(frame_table, num_frames);
+        }
+        if (options.f_flag) {
+            printFrameTable();
+        }
+    }
+    else {
+        throw std::runtime_error("Invalid operation");
+    }
+}
+
+
+// Execute a batch of trace instructions
+void Simulator::run(std::span<const instruction_t> instructions) {
+    size_t next = 0;
+    while (next < instructions.size()) {
+        if (fast_forward) {
+            next += skip_resident_hits(instructions.subspan(next));
+            if (next == instructions.size()) {
+                break;
             }
         }
+        step(instructions[next++]);
+    }
+}
+
+
+// Apply the leading run of r/w instructions that hit resident pages of the
+// current process in bulk, returns how many were consumed. Stops at the first
+// instruction that needs execute(): a fault, SEGPROT, COW, c, e or f.
+size_t Simulator::skip_resident_hits(std::span<const instruction_t> instructions) {
+    if (current_process == nullptr) {
+        return 0;
+    }
+    pte_t* page_table = current_process->page_table;
+    size_t limit = instructions.size();
+    if (tiers) {
+        // Leave the next hotness scan to execute()
+        limit = std::min<size_t>(limit, tiers->next_scan - std::min(tiers->next_scan, gstats.instructions()));
+    }
+    size_t count = 0;
+    for (; count < limit; count++) {
+        const instruction_t& instruction = instructions[count];
+        if ((unsigned)instruction.arg >= MAX_VPAGES) {
+            break;
+        }
+        pte_t& pte = page_table[instruction.arg];
+        if (!pte.PRESENT) {
+            break;
+        }
+        if (instruction.op == 'r') {
+            pte.REFERENCED = 1;
+        }
+        else if (instruction.op == 'w' && !pte.WRITE_PROTECT && !pte.COPY_ON_WRITE) {
+            pte.REFERENCED = 1;
+            pte.MODIFIED = 1;
+        }
         else {
-            std::cout << "Invalid operation" << std::endl;
-            exit(1);
+            break;
+        }
+        if (tiers) {
+            if ((int)pte.PHYSICAL_FRAME_NUMBER < num_frames) gstats.fast_hits++;
+            else gstats.slow_hits++;
         }
-        instruction_number++;
     }
-    if (do_show_pagetable) {
-        for (auto& [id, process] : processes) {
-            printPageTable(&process);
+    if (count > 0) {
+        // Pagers only look at the clock when selecting a victim, so advancing it
+        // once per run lands NRU resets and Working Set ages where single steps would
+        gstats.inst_count += count;
+        instruction_number += count;
+        pager->skip_instructions(count);
+        if (local_replacement) {
+            pff_quota(current_process->process_id).vtime += count;
         }
     }
-    if (do_show_frametable) {
-        printFrameTable(frame_table, num_frames);
+    return count;
+}
+
+
+// End of trace: run what load control still holds back, then print the requested summaries
+void Simulator::finish() {
+    if (load_control) {
+        load_control->deferring = -1;
+        if (current_process != nullptr) {
+            update_working_set(current_process->process_id);
+        }
+        // The trace is over, so are the slices of the running processes: only
+        // the deferred slices are left, and they run one process at a time
+        for (int pid = 0; pid < arena.size(); pid++) {
+            working_set_t& ws = working_set(pid);
+            if (!ws.suspended) {
+                load_control->total -= ws.size;
+                ws.size = 0;
+            }
+        }
+        while (!load_control->suspended.empty()) {
+            int pid = load_control->suspended.front();
+            resume_process(pid);
+            working_set_t& ws = working_set(pid);
+            load_control->total -= ws.size;
+            ws.size = 0;
+        }
+    }
+    if (delta) {
+        record_delta();
+        delta->out->flush();
+    }
+    if (options.do_show_pagetable) {
+        for (int id = 0; id < arena.size(); id++) {
+            printPageTable(&arena[id]);
+        }
+    }
+    if (options.do_show_frametable) {
+        printFrameTable();
+    }
+    if (options.do_show_stats) {
+        for (int id = 0; id < arena.size(); id++) {
+            printProcessStatistics(&arena[id]);
+        }
+        printGlobalStatistics();
+        if (!page_cache.empty() || gstats.cache_hits) {
+            sink->printf("PAGECACHE hits=%lu\n", gstats.cache_hits);
+        }
+        if (gstats.forks) {
+            unsigned long cow_copies = 0;
+            for (int id = 0; id < arena.size(); id++) {
+                cow_copies += arena[id].pstats.cows;
+            }
+            sink->printf("COW forks=%lu shared=%lu copied=%lu\n", gstats.forks, gstats.cow_shared_pages, cow_copies);
+        }
+        if (load_control) {
+            sink->printf("LOADCTL tau=%lu thrashing=%lu suspensions=%lu resumes=%lu\n",
+                    load_control->tau,
+                    load_control->thrash_time,
+                    load_control->suspensions,
+                    load_control->resumes);
+        }
+        if (local_replacement) {
+            printQuotas();
+        }
+        if (tiers) {
+            unsigned long hits = gstats.fast_hits + gstats.slow_hits;
+            sink->printf("TIERS fast=%d slow=%d fasthits=%lu slowhits=%lu fastrate=%.4f promotions=%lu demotions=%lu\n",
+                    num_frames,
+                    tiers->slow_frames,
+                    gstats.fast_hits,
+                    gstats.slow_hits,
+                    hits ? (double)gstats.fast_hits / hits : 0.0,
+                    gstats.promotions,
+                    gstats.demotions);
+        }
+        if (swap.cluster > 1) {
+            sink->printf("SWAP cluster=%d slots=%zu writes=%lu/%lu reads=%lu/%lu readahead=%lu\n",
+                    swap.cluster,
+                    swap.refs.size(),
+                    swap.write_ios,
+                    swap.write_pages,
+                    swap.read_ios,
+                    swap.read_pages,
+                    swap.readahead_hits);
+        }
+    }
+}
+
+
+// Snapshot of the statistics so far
+simulation_stats Simulator::stats() const {
+    simulation_stats snapshot;
+    snapshot.global = gstats;
+    for (int id = 0; id < arena.size(); id++) {
+        snapshot.processes.push_back(arena[id].pstats);
     }
-    if (do_show_stats) {
-        for (auto& [id, process] : processes) {
-            printProcessStatistics(&process);
+    snapshot.cost = total_cost();
+    snapshot.thrash_time = load_control ? load_control->thrash_time : 0;
+    snapshot.suspensions = load_control ? load_control->suspensions : 0;
+    if (local_replacement) {
+        for (int id = 0; id < arena.size(); id++) {
+            bool known = id < (int)local_replacement->processes.size();
+            snapshot.quotas.push_back(known ? local_replacement->processes[id].quota : 0);
         }
-        printGlobalStatistics(processes, gstats);
     }
+    snapshot.write_ios = swap.write_ios;
+    snapshot.write_pages = swap.write_pages;
+    snapshot.read_ios = swap.read_ios;
+    snapshot.read_pages = swap.read_pages;
+    snapshot.readahead_hits = swap.readahead_hits;
+    return snapshot;
 }
 
 
-// ====================|  Main  |===========================
-int main(int argc, char **argv) {
-    int num_frames = MAX_FRAMES;
-    int c;
-    char algo = 'f';
-    std::string input_file = "../lab3_assign/in1";
-    std::string rfile = "rfile";
+// ====================|  Load Control  |===========================
 
-    while ((c = getopt(argc,argv,"f:a:o:xyfa")) != -1 ){
-        switch(c) {
-            case 'f':
-                num_frames = atoi(optarg);
-                break;
-            case 'a':
-                algo = optarg[0];
-                break;
-            case 'o':
-                if (optarg && *optarg) {
-                    for (int i = 0; optarg[i] != '\0'; i++) {
-                        switch(optarg[i]) {
-                            case 'O':
-                                do_show_output = true;
-                                break;
-                            case 'P':
-                                do_show_pagetable = true;
-                                break;
-                            case 'F':
-                                do_show_frametable = true;
-                                break;
-                            case 'S':
-                                do_show_stats = true;
-                                break;
-                            case 'x':
-                                x_flag = true;
-                                break;
-                            case 'y':  
-                                y_flag = true;
-                                x_flag = false;
-                                break;
-                            case 'f':
-                                f_flag = true;
-                                do_verbose = true;
-                            case 'a':
-                                a_flag = true;
-                                break;
-                        }
-                    }
-                }
 
-        }   
+working_set_t& Simulator::working_set(int pid) {
+    if (pid >= (int)load_control->processes.size()) {
+        load_control->processes.resize(pid + 1);
     }
+    return load_control->processes[pid];
+}
+
 
-    if ((argc - optind) == 2) {
-        input_file = argv[optind];
-        rfile = argv[optind+1];
+// Recount the pages a process referenced within its last tau references
+void Simulator::update_working_set(int pid) {
+    working_set_t& ws = working_set(pid);
+    if (ws.exited) {
+        return;
     }
-    else if ((argc - optind) == 1) {
-        input_file = argv[optind];
+    int size = 0;
+    for (int i = 0; i < MAX_VPAGES; i++) {
+        if (ws.last_ref[i] != 0 && ws.vtime - ws.last_ref[i] < load_control->tau) {
+            size++;
+        }
     }
-    else if ((argc - optind) == 0) {
+    if (!ws.suspended) {
+        load_control->total += size - ws.size;
     }
-    else {
-        exit(1);
+    ws.size = size;
+}
+
+
+// Context switch under load control. Suspended processes that fit again are
+// resumed first; the target's slice is deferred if it is (or becomes) suspended.
+void Simulator::load_control_switch(const instruction_t& instruction) {
+    int pid = instruction.arg;
+    load_control->deferring = -1;
+    if (current_process != nullptr) {
+        update_working_set(current_process->process_id);
     }
 
-    global_stats gstats = global_stats();
+    while (!load_control->suspended.empty()) {
+        working_set_t& ws = working_set(load_control->suspended.front());
+        if (load_control->total + ws.size > num_frames && load_control->total > 0) {
+            break;
+        }
+        resume_process(load_control->suspended.front());
+    }
 
+    // Thrashing: suspend the largest working set until the rest fits,
+    // as long as another process with a working set keeps running
+    while (load_control->total > num_frames) {
+        int victim = -1;
+        int running = 0;
+        for (int i = 0; i < arena.size(); i++) {
+            working_set_t& ws = working_set(i);
+            if (ws.suspended || ws.exited || ws.size == 0) continue;
+            running++;
+            if (victim < 0 || ws.size > working_set(victim).size) {
+                victim = i;
+            }
+        }
+        if (running < 2) break;
+        suspend_process(victim);
+    }
 
-    pagerClass* pager = nullptr;
-    if (algo == 'f') {
-        pager = new FIFO(num_frames);
+    if (pid >= 0 && pid < arena.size() && working_set(pid).suspended) {
+        load_control->deferring = pid;
+        working_set(pid).deferred.push_back(instruction);
+        return;
     }
-    else if (algo == 'r') {
-        Randomizer randomizer(rfile);
-        pager = new Random(num_frames, randomizer);
+    execute(instruction);
+}
+
+
+void Simulator::suspend_process(int pid) {
+    working_set_t& ws = working_set(pid);
+    output(" SUSPEND %d\n", pid);
+    ws.suspended = true;
+    ws.swapped_out = true;
+    load_control->total -= ws.size;
+    load_control->suspended.push_back(pid);
+    load_control->suspensions++;
+    swap_out_process(&arena[pid]);
+}
+
+
+// Run the slices a process accumulated while suspended
+void Simulator::resume_process(int pid) {
+    working_set_t& ws = working_set(pid);
+    load_control->suspended.pop_front();
+    output(" RESUME %d\n", pid);
+    ws.suspended = false;
+    load_control->total += ws.size;
+    if (ws.swapped_out) {
+        load_control->resumes++;
+        ws.swapped_out = false;
     }
-    else if (algo == 'c') {
-        pager = new Clock(num_frames);
+
+    std::vector<instruction_t> deferred;
+    deferred.swap(ws.deferred);
+    for (const instruction_t& instruction : deferred) {
+        execute(instruction);
     }
-    else if (algo == 'e') {
-        pager = new NRU(num_frames);
+    if (!deferred.empty()) {
+        update_working_set(pid);
     }
-    else if (algo == 'a') {
-        pager = new Aging(num_frames);
+}
+
+
+// Release all frames of a suspended process at once, dirty pages are written back
+void Simulator::swap_out_process(process_object* process) {
+    if (delta) delta->mark_process(process->process_id);
+    for (int i = 0; i < MAX_VPAGES; i++) {
+        pte_t& pte = process->page_table[i];
+        if (!pte.PRESENT) {
+            continue;
+        }
+        frame_t* frame = &frame_table[pte.PHYSICAL_FRAME_NUMBER];
+        frame_table.mark(frame);
+        VMA* vma = find_vma(process, i);
+        output(" UNMAP %d:%d\n", process->process_id, i);
+        process->pstats.unmaps++;
+        bool dirty = pte.MODIFIED;
+        bool frame_released = frame_table.remove_mapping(frame, process->process_id, i);
+        if (!frame_released) {
+            // Still mapped elsewhere: the other mappers carry the dirty state
+            if (dirty) frame_table.pte(frame).MODIFIED = 1;
+            bool modified = frame_table.modified(frame);
+            if (!vma->file_mapped && modified) pte.PAGEDOUT = 1;
+            // The frame's copy is written when it leaves memory, the PTE waits for its slot
+            if (pte.PAGEDOUT && modified) wait_for_slot(frame, process->process_id, i);
+            else if (pte.PAGEDOUT) set_swap_slot(pte, frame_table.cold(frame).swap_slot);
+        }
+        else {
+            int slot = frame_table.cold(frame).swap_slot;
+            if (dirty && vma->file_mapped) {
+                output(" FOUT\n");
+                process->pstats.fouts++;
+            }
+            else if (dirty) {
+                output(" OUT\n");
+                process->pstats.outs++;
+                pte.PAGEDOUT = 1;
+                slot = swap_write();
+            }
+            if (pte.PAGEDOUT) {
+                set_swap_slot(pte, slot);
+            }
+            resolve_slot_waiters(frame, slot);
+            uncache_frame(frame);
+            release_frame(frame);
+        }
+        pte.PRESENT = 0;
+        pte.MODIFIED = 0;
+        pte.COPY_ON_WRITE = 0;
     }
-    else if (algo == 'w') {
+    flush_swap_writes();
+}
+
+
+// ====================|  Local Replacement  |===========================
+
 
-        pager = new WorkingSet(num_frames, gstats);
+pff_quota_t& Simulator::pff_quota(int pid) {
+    return local_replacement->process(pid);
+}
+
+
+// Frame for a fault under local replacement. The interval since the process'
+// previous fault adjusts its quota first; below the quota it takes a free frame,
+// otherwise the pager replaces one of its own frames. A process without frames
+// of its own falls back to global replacement when memory is full.
+frame_t* Simulator::allocate_local_frame(process_object* process) {
+    int pid = process->process_id;
+    pff_quota_t& pff = pff_quota(pid);
+    // Frames it holds as primary mapper, pages shared from others are not charged
+    int resident = (int)pff.frames.size();
+    unsigned long interval = pff.vtime - pff.last_fault;
+    pff.last_fault = pff.vtime;
+    pff.faults++;
+
+    if (pff.quota == 0) {
+        pff.quota = std::max(1, num_frames / arena.size());
+    }
+    else if (interval * local_replacement->upper < 1000 && pff.quota < num_frames) {
+        pff.quota++;
+        pff.grows++;
+        output(" QUOTA %d %d\n", pid, pff.quota);
+    }
+    else if (interval * local_replacement->lower > 1000 && pff.quota > 1) {
+        pff.quota--;
+        pff.shrinks++;
+        output(" QUOTA %d %d\n", pid, pff.quota);
+        if (resident > pff.quota) {
+            // Give one frame back to the free list
+            pager->scope = pid;
+            pager->scope_frames = &pff.frames;
+            frame_t* released = pager->select_victim_frame(frame_table);
+            pager->scope = -1;
+            evict_frame(released);
+            release_frame(released);
+            resident--;
+        }
+    }
+
+    frame_t* frame = nullptr;
+    if (resident < pff.quota) {
+        frame = allocate_frame_from_free_list();
+    }
+    if (frame == nullptr) {
+        pager->scope = resident > 0 ? pid : -1;
+        pager->scope_frames = &pff.frames;
+        frame = reclaim_frames();
+        pager->scope = -1;
+    }
+    return frame;
+}
+
+
+void Simulator::printQuotas() {
+    for (int id = 0; id < arena.size(); id++) {
+        pff_quota_t& pff = pff_quota(id);
+        sink->printf("PFF[%d]: Q=%d R=%d F=%lu G=%lu S=%lu\n",
+                id,
+                pff.quota,
+                (int)pff.frames.size(),
+                pff.faults,
+                pff.grows,
+                pff.shrinks);
+    }
+}
+
+
+// ====================|  Memory Tiers  |===========================
+
+
+// Free slow frame for a demotion. If there is none, the clock hand ages the
+// slow pages it passes and evicts the first one not referenced since its
+// last visit, which takes at most one revolution. With swap clustering the
+// hand goes on for cluster - 1 more frames and also evicts the cold pages
+// among them, to the free list.
+frame_t* Simulator::slow_frame() {
+    if (!tiers->free_list.empty()) {
+        frame_t* frame = &frame_table[tiers->free_list.front()];
+        tiers->free_list.pop_front();
+        return frame;
+    }
+    frame_t* victim = nullptr;
+    while (victim == nullptr) {
+        int index = tiers->hand;
+        tiers->hand = (tiers->hand + 1) % tiers->slow_frames;
+        if (!(age_slow_frame(index) & 0x80000000)) {
+            victim = &frame_table[num_frames + index];
+            evict_frame(victim);
+        }
+    }
+    int batch = std::min(swap.cluster, tiers->slow_frames) - 1;
+    for (int i = 0; i < batch; i++) {
+        int index = tiers->hand;
+        tiers->hand = (tiers->hand + 1) % tiers->slow_frames;
+        frame_t* frame = &frame_table[num_frames + index];
+        if (frame_table.mapped(frame) && !(age_slow_frame(index) & 0x80000000)) {
+            evict_frame(frame);
+            release_frame(frame);
+        }
+    }
+    return victim;
+}
+
+
+// Move the page of a fast frame the pager selected down to the slow tier
+void Simulator::demote_frame(frame_t* frame) {
+    frame_t* target = slow_frame();
+    exchange_frames(frame, target);
+    tiers->age[frame_table.id(target) - num_frames] = 0;
+    output(" DEMOTE %d:%d %d\n", target->process_id(), target->vpage(), frame_table.id(target));
+    gstats.demotions++;
+}
+
+
+// Move a hot slow-tier page up, swapping it with the fast tier's victim
+void Simulator::promote_frame(frame_t* frame) {
+    frame_t* target = allocate_frame_from_free_list();
+    if (target == nullptr) {
+        target = pager->select_victim_frame(frame_table);
+    }
+    exchange_frames(frame, target);
+    output(" PROMOTE %d:%d %d\n", target->process_id(), target->vpage(), frame_table.id(target));
+    gstats.promotions++;
+    pager->reset_age(frame_table.id(target));
+    tiers->age[frame_table.id(frame) - num_frames] = 0;
+    if (frame_table.mapped(frame)) {
+        output(" DEMOTE %d:%d %d\n", frame->process_id(), frame->vpage(), frame_table.id(frame));
+        gstats.demotions++;
     }
     else {
-        std::cout << "Invalid algorithm" << std::endl;
-        exit(1);
+        tiers->free_list.push_back(frame_table.id(frame));
+    }
+}
+
+
+// Swap the pages held by two frames (either may be free)
+void Simulator::exchange_frames(frame_t* a, frame_t* b) {
+    if (delta) {
+        delta->mark_frame(frame_table.id(a));
+        delta->mark_frame(frame_table.id(b));
+    }
+    std::swap(*a, *b);
+    std::swap(frame_table.cold(a), frame_table.cold(b));
+    retarget_frame(a);
+    retarget_frame(b);
+}
+
+
+// Point every PTE and the page cache at the frame's new position
+void Simulator::retarget_frame(frame_t* frame) {
+    if (!frame_table.mapped(frame)) {
+        return;
+    }
+    int frame_id = frame_table.id(frame);
+    frame_cold_t& cold = frame_table.cold(frame);
+    frame_table.pte(frame).PHYSICAL_FRAME_NUMBER = frame_id;
+    for (auto& mapping : cold.shared_mappings) {
+        frame_table.pte(mapping).PHYSICAL_FRAME_NUMBER = frame_id;
+    }
+    for (int index : cold.slot_waiters) {
+        slot_waits[index] = frame_id;
+    }
+    if (cold.file_id >= 0) {
+        page_cache[{cold.file_id, cold.file_offset}] = frame_id;
+    }
+}
+
+
+// Advance the clock hand over a batch of slow frames, aging their pages by
+// their REFERENCED bits; pages referenced in the last two visits are promoted
+void Simulator::scan_slow_tier() {
+    tiers->next_scan = gstats.instructions() + TIER_SCAN_INTERVAL;
+    int batch = std::min(TIER_SCAN_BATCH, tiers->slow_frames);
+    for (int i = 0; i < batch; i++) {
+        int index = tiers->hand;
+        tiers->hand = (tiers->hand + 1) % tiers->slow_frames;
+        frame_t* frame = &frame_table[num_frames + index];
+        if (frame_table.mapped(frame) && (age_slow_frame(index) & 0xC0000000) == 0xC0000000) {
+            promote_frame(frame);
+        }
+    }
+}
+
+
+// Shift the REFERENCED bit of a slow page into its age and clear it
+uint32_t Simulator::age_slow_frame(int index) {
+    frame_t* frame = &frame_table[num_frames + index];
+    uint32_t& age = tiers->age[index];
+    age = (age >> 1) | (frame_table.test_and_clear_referenced(frame) ? 0x80000000 : 0);
+    return age;
+}
+
+
+// ====================|  Swap Device  |===========================
+
+
+// Swap out one page. The swap-outs of one reclaim are written as one I/O
+// when the reclaim ends or the cluster they go to is full.
+int Simulator::swap_write() {
+    if (swap.next_slot == swap.run_end) {
+        flush_swap_writes();
+        swap.next_slot = find_swap_run();
+        swap.run_end = swap.next_slot + swap.cluster;
+    }
+    if (swap.pending++ == 0) {
+        swap.write_ios++;
+    }
+    swap.write_pages++;
+    return swap.next_slot++;
+}
+
+
+void Simulator::flush_swap_writes() {
+    swap.pending = 0;
+}
+
+
+// Lowest cluster with no slot in use, the swap area grows by a cluster when
+// there is none. A cluster left with no slot in use while it was being
+// filled is free again.
+int Simulator::find_swap_run() {
+    int filled = swap.run_end / swap.cluster - 1;
+    if (swap.run_end > 0 && swap.used[filled] == 0) {
+        swap.free_clusters.insert(filled);
+    }
+    if (!swap.free_clusters.empty()) {
+        int run = *swap.free_clusters.begin();
+        swap.free_clusters.erase(swap.free_clusters.begin());
+        return run * swap.cluster;
+    }
+    int size = (int)swap.refs.size();
+    if ((long)size + swap.cluster > NO_SWAP_SLOT) {
+        throw std::runtime_error("Swap area full");
+    }
+    swap.refs.resize(size + swap.cluster, 0);
+    swap.resident.resize(size + swap.cluster, 0);
+    swap.cached.resize(size + swap.cluster, 0);
+    swap.used.push_back(0);
+    return size;
+}
+
+
+// Swap in one page. Pages in the swap cache cost nothing, any other read
+// also brings in the swapped-out pages in the slots that follow in its
+// cluster. They stay cached until faulted in or freed, the oldest giving
+// way beyond SWAP_CACHE_PAGES.
+void Simulator::swap_read(int slot) {
+    if (slot == NO_SWAP_SLOT) {
+        swap.read_ios++;
+        swap.read_pages++;
+        return;
+    }
+    if (swap.cached[slot]) {
+        uncache_slot(slot);
+        swap.readahead_hits++;
+        return;
+    }
+    int pages = 1;
+    int end = (slot / swap.cluster + 1) * swap.cluster;
+    for (int next = slot + 1; next < end; next++) {
+        // Only pages that are out of memory
+        if (swap.refs[next] > swap.resident[next] && !swap.cached[next]) {
+            swap.readahead.push_back(next);
+            swap.cached[next] = 1;
+            pages++;
+        }
+    }
+    if (swap.readahead.size() > SWAP_CACHE_PAGES) {
+        size_t excess = swap.readahead.size() - SWAP_CACHE_PAGES;
+        for (size_t i = 0; i < excess; i++) {
+            swap.cached[swap.readahead[i]] = 0;
+        }
+        swap.readahead.erase(swap.readahead.begin(), swap.readahead.begin() + excess);
+    }
+    swap.read_ios++;
+    swap.read_pages += pages;
+}
+
+
+void Simulator::uncache_slot(int slot) {
+    swap.readahead.erase(std::find(swap.readahead.begin(), swap.readahead.end(), slot));
+    swap.cached[slot] = 0;
+}
+
+
+// Record the page's copy in a swapped-out PTE, -1 if the slot is unknown
+void Simulator::set_swap_slot(pte_t& pte, int slot) {
+    if (slot < 0) {
+        pte.PHYSICAL_FRAME_NUMBER = NO_SWAP_SLOT;
+        return;
     }
-    std::ifstream file(input_file);
+    if (swap.refs[slot]++ == 0) {
+        swap.used[slot / swap.cluster]++;
+    }
+    pte.PHYSICAL_FRAME_NUMBER = slot;
+}
 
-    Randomizer randomizer(rfile);
+
+void Simulator::drop_swap_slot(int slot) {
+    if (slot < 0 || slot == NO_SWAP_SLOT) {
+        return;
+    }
+    if (--swap.refs[slot] == 0) {
+        if (swap.cached[slot]) {
+            uncache_slot(slot);
+        }
+        // The cluster being filled is freed when the next one is taken
+        int cluster = slot / swap.cluster;
+        if (--swap.used[cluster] == 0 && cluster != swap.run_end / swap.cluster - 1) {
+            swap.free_clusters.insert(cluster);
+        }
+    }
+}
 
 
-    std::map<int, process_object> processes = readInput(file);
-    simulation(num_frames, processes, file, pager, gstats);
-}
\ No newline at end of file
+// A resident page gives up its copy when it leaves its frame
+void Simulator::drop_frame_slot(frame_t* frame) {
+    frame_cold_t& cold = frame_table.cold(frame);
+    if (cold.swap_slot < 0) {
+        return;
+    }
+    swap.resident[cold.swap_slot]--;
+    drop_swap_slot(cold.swap_slot);
+    cold.swap_slot = -1;
+}
+
+
+// A page swapped out while its frame stays mapped by others and is dirty has
+// no copy in swap yet: its PTE waits for the slot the frame is written to
+void Simulator::wait_for_slot(frame_t* frame, int pid, int vpage) {
+    int index = pid * MAX_VPAGES + vpage;
+    arena.page_tables[index].PHYSICAL_FRAME_NUMBER = NO_SWAP_SLOT;
+    frame_table.cold(frame).slot_waiters.push_back(index);
+    slot_waits[index] = frame_table.id(frame);
+}
+
+
+// The frame's page leaves memory with its copy in the slot, -1 if none
+void Simulator::resolve_slot_waiters(frame_t* frame, int slot) {
+    frame_cold_t& cold = frame_table.cold(frame);
+    for (int index : cold.slot_waiters) {
+        set_swap_slot(arena.page_tables[index], slot);
+        slot_waits.erase(index);
+    }
+    cold.slot_waiters.clear();
+}
+
+
+// The waiting PTE was faulted in or went away before the frame was written
+void Simulator::cancel_slot_wait(int pid, int vpage) {
+    auto wait = slot_waits.find(pid * MAX_VPAGES + vpage);
+    if (wait == slot_waits.end()) {
+        return;
+    }
+    std::vector<int>& waiters = frame_table.cold(&frame_table[wait->second]).slot_waiters;
+    waiters.erase(std::find(waiters.begin(), waiters.end(), wait->first));
+    slot_waits.erase(wait);
+}
+
+
+// ====================|  Delta Tracing  |===========================
+
+
+static uint8_t delta_flags(const pte_t& pte) {
+    return (pte.PRESENT ? DELTA_PRESENT : 0) |
+        (pte.REFERENCED ? DELTA_REFERENCED : 0) |
+        (pte.MODIFIED ? DELTA_MODIFIED : 0) |
+        (pte.WRITE_PROTECT ? DELTA_WRITE_PROTECT : 0) |
+        (pte.PAGEDOUT ? DELTA_PAGEDOUT : 0) |
+        (pte.COPY_ON_WRITE ? DELTA_COPY_ON_WRITE : 0);
+}
+
+
+// Write the marked pages and frames that differ from what was last written,
+// as one group for the instructions executed since the previous group
+void Simulator::record_delta() {
+    std::string& buffer = delta->buffer;
+    buffer.push_back('I');
+    put_varint(buffer, instruction_number - delta->instructions);
+    size_t empty = buffer.size();
+
+    if (arena.size() != delta->processes) {
+        delta->processes = arena.size();
+        delta->pages.resize((size_t)arena.size() * MAX_VPAGES, 0);
+        buffer.push_back('N');
+        put_varint(buffer, arena.size());
+    }
+    for (int pid : delta->dirty_processes) {
+        uint64_t dirty = delta->dirty_pages[pid];
+        delta->dirty_pages[pid] = 0;
+        for (int vpage = 0; vpage < MAX_VPAGES; vpage++) {
+            if (!(dirty >> vpage & 1)) {
+                continue;
+            }
+            uint8_t flags = delta_flags(arena[pid].page_table[vpage]);
+            uint8_t& written = delta->pages[(size_t)pid * MAX_VPAGES + vpage];
+            if (flags != written) {
+                written = flags;
+                buffer.push_back('P');
+                put_varint(buffer, pid);
+                buffer.push_back((char)vpage);
+                buffer.push_back((char)flags);
+            }
+        }
+    }
+    delta->dirty_processes.clear();
+    for (int frame_id : delta->dirty_frames) {
+        delta->frame_dirty[frame_id] = 0;
+        frame_t& frame = frame_table[frame_id];
+        frame_t& written = delta->frames[frame_id];
+        if (frame.pte != written.pte) {
+            written = frame;
+            buffer.push_back('F');
+            put_varint(buffer, frame_id);
+            put_varint(buffer, frame.process_id() + 1);
+            buffer.push_back((char)frame.vpage());
+        }
+    }
+    delta->dirty_frames.clear();
+
+    // Nothing changed: the instructions are counted in the next group
+    if (buffer.size() == empty) {
+        buffer.clear();
+        return;
+    }
+    delta->instructions = instruction_number;
+    delta->out->write(buffer.data(), buffer.size());
+    buffer.clear();
+}
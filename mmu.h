@@ -3,35 +3,63 @@
 
 // Include any necessary libraries or headers
 //#include "verbose.h"
-#include "getopt.h"
 #include <iostream>
 #include <fstream>
 #include <sstream>
 #include <list>
 #include <map>
+#include <set>
+#include <memory>
 //#include "pager.h"
 #include <deque>
+#include <array>
+#include <span>
 #include <vector>
-#include "randomizer.cpp"
+#include <cstdint>
+#include "randomizer.h"
+#include "trace_reader.h"
 
 // Define any constants or macros
-bool do_show_output = false;
-bool do_show_pagetable = false;
-bool do_show_frametable = false;
-bool do_show_stats = false;
-bool do_verbose = false;
+#define MAX_VPAGES 64
+#define MAX_FRAMES (1 << 26)     // frames addressable by PHYSICAL_FRAME_NUMBER
+#define NO_SWAP_SLOT (MAX_FRAMES - 1)   // swapped-out PTE whose copy has no known slot
+#define TRACE_BATCH_SIZE 1024
+#define TIER_SCAN_INTERVAL 64   // instructions between hotness scans of the slow tier
+#define TIER_SCAN_BATCH 64      // slow frames aged per hotness scan
+#define SWAP_CACHE_PAGES 256   // read-ahead pages kept until faulted in or freed
 
-bool x_flag = false;
-bool y_flag = false;
-bool f_flag = false;    
-bool a_flag = false;
+// Output selection, set from the -o flags by the command line tool
+struct simulator_options {
+    bool do_show_output = false;
+    bool do_show_pagetable = false;
+    bool do_show_frametable = false;
+    bool do_show_stats = false;
+    bool do_verbose = false;
 
-#define MAX_VPAGES 64
-#define MAX_FRAMES 128
+    bool x_flag = false;
+    bool y_flag = false;
+    bool f_flag = false;
+    bool a_flag = false;
+};
+
+// Destination of everything a simulation prints, stdout unless replaced
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+    virtual void write(const char* text, size_t length) = 0;
+    void printf(const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+};
 
-#define output(fmt...)        do { if (do_show_output) {printf(fmt); fflush(stdout); } } while(0)
-#define verbose(fmt...)        do { if (do_verbose) {printf(fmt); fflush(stdout); } } while(0)
-#define a_output(fmt...)        do { if (a_flag) {printf(fmt); fflush(stdout); } } while(0)
+class StdoutSink : public OutputSink {
+public:
+    void write(const char* text, size_t length) override;
+};
+
+// Discards all output, for simulations that only want the statistics
+class NullSink : public OutputSink {
+public:
+    void write(const char* text, size_t length) override {}
+};
 
 // Declare any classes, structs, or functions
 typedef struct {
@@ -40,8 +68,10 @@ typedef struct {
     unsigned int MODIFIED:1;
     unsigned int WRITE_PROTECT:1;
     unsigned int PAGEDOUT:1;
-    unsigned int PHYSICAL_FRAME_NUMBER:7;
+    unsigned int COPY_ON_WRITE:1;
+    unsigned int PHYSICAL_FRAME_NUMBER:26;
 } pte_t; // can only be total of 32-bit size and will check on this
+// While a page is not present and PAGEDOUT, PHYSICAL_FRAME_NUMBER holds its swap slot
 
 
 struct VMA {
@@ -50,17 +80,20 @@ struct VMA {
     int write_protected;
     int id;
     bool file_mapped;
+    int file_id;        // shared page cache key, -1 if the mapping is private
 
     VMA(int start_vpage_input, 
         int end_vpage_input, 
         int write_protected_input, 
         int id_input,
-        bool file_mapped_input) :
+        bool file_mapped_input,
+        int file_id_input = -1) :
         start_vpage(start_vpage_input),
         end_vpage(end_vpage_input),
         write_protected(write_protected_input),
         id(id_input),
-        file_mapped(file_mapped_input) {}
+        file_mapped(file_mapped_input),
+        file_id(file_id_input) {}
 
     VMA() {}
 };
@@ -69,7 +102,17 @@ struct global_stats{
     unsigned long inst_count;
     unsigned long ctx_switches;
     unsigned long process_exits;
-    global_stats() : inst_count(0), ctx_switches(0), process_exits(0) {}
+    unsigned long forks;
+    unsigned long cache_hits;
+    unsigned long cow_shared_pages;     // pages an eager fork would have copied
+    unsigned long fast_hits;            // references to resident pages, by memory tier
+    unsigned long slow_hits;
+    unsigned long promotions;
+    unsigned long demotions;
+    global_stats() : inst_count(0), ctx_switches(0), process_exits(0), forks(0), cache_hits(0), cow_shared_pages(0),
+        fast_hits(0), slow_hits(0), promotions(0), demotions(0) {}
+    // Every trace instruction advances simulated time by one
+    unsigned long instructions() const { return inst_count + ctx_switches + process_exits + forks; }
 };
 
 struct process_stats{
@@ -82,30 +125,202 @@ struct process_stats{
     unsigned long zeros;
     unsigned long segv;
     unsigned long segprot;
-    process_stats() : unmaps(0), maps(0), ins(0), outs(0), fins(0), fouts(0), zeros(0), segv(0), segprot(0) {}
+    unsigned long cows;
+    process_stats() : unmaps(0), maps(0), ins(0), outs(0), fins(0), fouts(0), zeros(0), segv(0), segprot(0), cows(0) {}
 };
 
 struct process_object{
-    pte_t page_table[MAX_VPAGES]= {0,0,0,0,0,0};
+    pte_t* page_table;  // slice of process_arena::page_tables
     int process_id;
     int number_of_VMA;
-    std::vector<VMA> VMA_list;
+    VMA* VMA_list;      // slice of process_arena::vmas, shared with forked children
     process_stats pstats;
-    process_object(std::vector<VMA> VMA_list_input) : VMA_list(VMA_list_input), pstats(process_stats()) {}
-    process_object() {}
+    process_object() : page_table(nullptr), process_id(0), number_of_VMA(0), VMA_list(nullptr) {}
     };
 
+// All processes, indexed by process id. Processes are stored in fixed-size
+// chunks so that forks can grow the arena without moving existing processes
+// (current_process and other process_object pointers stay valid across
+// fork-driven growth). VMAs of all processes live in one flat array that is
+// filled while parsing the input and never grows after. The page tables live
+// in one flat array as well, so that a frame finds its PTE by a single index;
+// the processes' page_table pointers are moved along when it grows.
+class process_arena {
+public:
+    static const int CHUNK_SIZE = 256;
+    std::vector<VMA> vmas;
+    std::vector<pte_t> page_tables;             // pid * MAX_VPAGES + vpage
+
+    process_arena() : count(0) {}
+    // A copy is independent of the original: its processes refer to slices
+    // of its own VMA array, so a parsed spec can seed many simulations
+    process_arena(const process_arena& other);
+    process_arena& operator=(const process_arena& other);
+    int size() const { return count; }
+    process_object& operator[](int id) { return chunks[id / CHUNK_SIZE][id % CHUNK_SIZE]; }
+    const process_object& operator[](int id) const { return chunks[id / CHUNK_SIZE][id % CHUNK_SIZE]; }
+    // Bounds-checked lookup, nullptr for an unknown id
+    process_object* find(int id) {
+        if (id < 0 || id >= count) return nullptr;
+        return &(*this)[id];
+    }
+    // Append the process with the next free id
+    process_object& add();
+
+private:
+    std::vector<std::unique_ptr<process_object[]>> chunks;
+    int count;
+};
+
+// Additional process mapping a frame that is shared through the page cache or a fork
 typedef struct {
-    pte_t *mapped_pte;
-    process_object *mapped_process;
-    int mapped_process_id;
-    int mapped_vpage;
-    int mapped_vma_id;
-    int id;
-    unsigned long age;
-    unsigned long last_used;
+    int process_id;
+    int vpage;
+} frame_mapping_t;
+
+#define FRAME_FREE -1
+
+// Hot part of a frame descriptor, all a pager scan reads. The primary
+// mapper's PTE is one index into process_arena::page_tables, its process id
+// and vpage are derived from it, the frame id from the position in the table.
+typedef struct {
+    int32_t pte;            // pid * MAX_VPAGES + vpage of the primary mapper, FRAME_FREE if unmapped
+    uint8_t shared;         // other processes map the frame as well (see frame_cold_t)
+
+    int process_id() const { return pte == FRAME_FREE ? FRAME_FREE : pte / MAX_VPAGES; }
+    int vpage() const { return pte == FRAME_FREE ? 0 : pte % MAX_VPAGES; }
 } frame_t;
 
+// Cold part of a frame descriptor, only touched on faults and evictions
+typedef struct {
+    int file_id;            // page cache key of the cached page, -1 if not cached
+    int file_offset;
+    int swap_slot;          // slot still holding a copy of the (clean) page, -1 if none
+    std::vector<frame_mapping_t> shared_mappings;
+    std::vector<int> slot_waiters;  // swapped-out PTEs (pid * MAX_VPAGES + vpage) of former
+                                    // mappers, given the slot the dirty page is written to
+} frame_cold_t;
+
+// Delta trace format: "MMUD", a version byte and the fast and slow frame
+// counts, then groups of records. Integers are LEB128 varints.
+//   'I' <instructions since the previous group>     starts a group, the changes
+//                                                   those instructions made follow
+//   'N' <processes>                                 the arena grew
+//   'P' <pid> <vpage byte> <flags byte>             PTE flags, DELTA_* bits
+//   'F' <frame> <pid + 1, 0 if free> <vpage byte>  frame descriptor
+#define DELTA_MAGIC "MMUD"
+#define DELTA_VERSION 1
+#define DELTA_PRESENT       0x01
+#define DELTA_REFERENCED    0x02
+#define DELTA_MODIFIED      0x04
+#define DELTA_WRITE_PROTECT 0x08
+#define DELTA_PAGEDOUT      0x10
+#define DELTA_COPY_ON_WRITE 0x20
+
+// Pages and frames changed since the last group of delta records. Every path
+// that changes a PTE's flags or a frame descriptor marks it; the shadows hold
+// what was last written, so a mark that changed nothing costs no record.
+struct delta_trace_t {
+    std::ostream* out;
+    std::string buffer;
+    std::vector<uint64_t> dirty_pages;          // per process, one bit per vpage
+    std::vector<int> dirty_processes;
+    std::vector<uint8_t> frame_dirty;
+    std::vector<int> dirty_frames;
+    std::vector<uint8_t> pages;                 // flags last written, per process and vpage
+    std::vector<frame_t> frames;                // descriptors last written
+    int processes = 0;
+    unsigned long instructions = 0;             // at the last group
+
+    void mark_page(int pid, int vpage) {
+        if (pid >= (int)dirty_pages.size()) {
+            dirty_pages.resize(pid + 1, 0);
+        }
+        if (dirty_pages[pid] == 0) {
+            dirty_processes.push_back(pid);
+        }
+        dirty_pages[pid] |= 1ULL << vpage;
+    }
+    void mark_process(int pid) {
+        mark_page(pid, 0);
+        dirty_pages[pid] = ~0ULL;
+    }
+    void mark_frame(int frame_id) {
+        if (!frame_dirty[frame_id]) {
+            frame_dirty[frame_id] = 1;
+            dirty_frames.push_back(frame_id);
+        }
+    }
+};
+
+struct local_replacement_t;
+
+// Physical frames, with the hot and cold descriptor parts in separate arrays
+class frame_table_t {
+public:
+    frame_table_t(int num_frames, process_arena& processes);
+
+    int size() const { return (int)frames.size(); }
+    frame_t* data() { return frames.data(); }
+    frame_t& operator[](int id) { return frames[id]; }
+    int id(const frame_t* frame) const { return frame - frames.data(); }
+    frame_cold_t& cold(const frame_t* frame) { return colds[id(frame)]; }
+    bool mapped(const frame_t* frame) const { return frame->pte != FRAME_FREE; }
+    process_object& process(const frame_t* frame) { return arena[frame->process_id()]; }
+    pte_t& pte(const frame_t* frame) { return arena.page_tables[frame->pte]; }
+    pte_t& pte(const frame_mapping_t& mapping) {
+        return arena.page_tables[(size_t)mapping.process_id * MAX_VPAGES + mapping.vpage];
+    }
+
+    // A frame counts as referenced/modified if any PTE mapping it is. The
+    // common unshared case resolves the PTE once and stays in the header.
+    bool referenced(const frame_t* frame) {
+        if (frame->shared) return shared_referenced(frame);
+        return pte(frame).REFERENCED;
+    }
+    bool modified(const frame_t* frame);
+    void clear_referenced(const frame_t* frame) {
+        if (frame->shared || delta) {
+            shared_clear_referenced(frame);
+            return;
+        }
+        pte(frame).REFERENCED = 0;
+    }
+    // Returns whether the frame was referenced, for scans that read and clear
+    bool test_and_clear_referenced(const frame_t* frame) {
+        if (frame->shared || delta) {
+            bool referenced = shared_referenced(frame);
+            shared_clear_referenced(frame);
+            return referenced;
+        }
+        pte_t& entry = pte(frame);
+        bool referenced = entry.REFERENCED;
+        entry.REFERENCED = 0;
+        return referenced;
+    }
+    void map(frame_t* frame, int process_id, int vpage);
+    void add_mapping(frame_t* frame, int process_id, int vpage);
+    bool remove_mapping(frame_t* frame, int process_id, int vpage);
+    // Mark the frame and every PTE mapping it for the delta trace
+    void mark(const frame_t* frame);
+    // Change the primary mapper, FRAME_FREE to free the frame
+    void set_owner(frame_t* frame, int process_id, int vpage = 0);
+
+    delta_trace_t* delta = nullptr;             // only while delta tracing
+    local_replacement_t* local = nullptr;       // only under local replacement
+
+private:
+    bool shared_referenced(const frame_t* frame);
+    void shared_clear_referenced(const frame_t* frame);
+
+    std::vector<frame_t> frames;
+    std::vector<frame_cold_t> colds;
+    process_arena& arena;
+};
+
+// Global page cache: (file id, page offset in file) -> frame id
+typedef std::map<std::pair<int, int>, int> page_cache_t;
+
 typedef struct name {
     int integer;
     name() : integer(0) {}
@@ -115,61 +330,311 @@ class pagerClass {
 public:
     pagerClass(const std::string& scheduler_type, int n_f) : 
         type(scheduler_type),
+        hand(0),
         num_frames(n_f),
-        hand(0) {}
+        scope(-1),
+        scope_frames(nullptr),
+        sink(nullptr) {}
+    virtual ~pagerClass() {}
     std::string type;
     int hand;
     int num_frames;
-    virtual frame_t* select_victim_frame(frame_t* frame_table) = 0; // virtual base class
+    int scope;                      // only frames of this process may be selected, -1 for all
+    const std::set<int>* scope_frames;  // frames of the scope process, in frame order
+    simulator_options options;      // copied from the owning Simulator
+    OutputSink* sink;
+    // `count` distinct victims from a single scan, the best first; count must
+    // not exceed scan_length()
+    virtual void select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) = 0;
+    frame_t* select_victim_frame(frame_table_t& frame_table) {
+        frame_t* victim;
+        select_victim_frames(frame_table, &victim, 1);
+        return victim;
+    }
     virtual void update_instr_count() {};
-    virtual void reset_age(frame_t* frame) {};
+    virtual void skip_instructions(unsigned long count) {};    // update_instr_count() count times
+    virtual void reset_age(int frame_id) {};                    // a page was just mapped into the frame
+    // Global selection only runs on a full frame table, local selection only
+    // visits the frames of the scope process: the first one at or after a
+    // frame, and the next one after a frame, wrapping around
+    int first_frame(int frame_id) const {
+        if (scope < 0) return frame_id;
+        auto it = scope_frames->lower_bound(frame_id);
+        return it != scope_frames->end() ? *it : *scope_frames->begin();
+    }
+    int next_frame(int frame_id) const {
+        // No division: the scan would wait on it for every frame
+        return first_frame(frame_id + 1 == num_frames ? 0 : frame_id + 1);
+    }
+    int scan_length() const {
+        return scope < 0 ? num_frames : (int)scope_frames->size();
+    }
 };
 
 class FIFO : public pagerClass {
     public:
     FIFO(int n_f) : pagerClass("FIFO", n_f) {}
-    int hand;
-    frame_t* select_victim_frame(frame_t* frame_table) override;
+    void select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) override;
 };
 
 class Random : public pagerClass {
     public:
     Randomizer randomizer;
-    Random(int n_f, Randomizer& _randomizer) : pagerClass("Random", n_f), randomizer(_randomizer) {}
-    int hand;
-    frame_t* select_victim_frame(frame_t* frame_table) override;
+    Random(int n_f, const Randomizer& _randomizer) : pagerClass("Random", n_f), randomizer(_randomizer) {}
+    void select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) override;
 };
 
 class Clock : public pagerClass {
     public:
     Clock(int n_f) : pagerClass("Clock", n_f) {}
-    int hand;
-    frame_t* select_victim_frame(frame_t* frame_table) override;
+    void select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) override;
 };
 
 class NRU : public pagerClass {
     public:
     int time_since_reset;
     NRU(int n_f) : pagerClass("NRU", n_f), time_since_reset(0){}
-    int hand;
-    frame_t* select_victim_frame(frame_t* frame_table) override;
+    void select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) override;
     void update_instr_count() override;
+    void skip_instructions(unsigned long count) override;
 };
 
 class Aging : public pagerClass {
     public:
-    Aging(int n_f) : pagerClass("Aging", n_f) {}
-    int hand;
-    frame_t* select_victim_frame(frame_t* frame_table) override;
-    void reset_age(frame_t* frame) override;
+    std::vector<uint32_t> age;              // indexed by frame id
+    Aging(int n_f) : pagerClass("Aging", n_f), age(n_f, 0) {}
+    void select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) override;
+    void reset_age(int frame_id) override;
 };
 
 class WorkingSet : public pagerClass {
     public:
     global_stats &gstats;
-    WorkingSet(int n_f, global_stats& _gstats) : pagerClass("WorkingSet", n_f), gstats(_gstats) {}
-    int hand;
-    frame_t* select_victim_frame(frame_t* frame_table) override;
+    unsigned long tau;
+    std::vector<unsigned long> last_used;   // indexed by frame id
+    WorkingSet(int n_f, global_stats& _gstats, unsigned long _tau) : pagerClass("WorkingSet", n_f), gstats(_gstats), tau(_tau), last_used(n_f, 0) {}
+    void select_victim_frames(frame_table_t& frame_table, frame_t** victims, int count) override;
+    void reset_age(int frame_id) override;
+};
+
+// Working set of one process for load control, measured in the process'
+// own virtual time (its r/w instructions) so it does not decay while the
+// process is switched out
+struct working_set_t {
+    unsigned long vtime = 0;
+    unsigned long last_ref[MAX_VPAGES] = {};    // vtime of the last reference, 0 if never
+    int size = 0;                               // pages referenced in the last tau references
+    bool suspended = false;
+    bool exited = false;
+    bool reserved = false;                      // id taken by a fork in a deferred slice
+    bool swapped_out = false;                   // suspended by load control (not just reserved)
+    std::vector<instruction_t> deferred;        // slices postponed while suspended
+};
+
+// Load control for the Working Set pager: keeps the working sets of the
+// running processes within the frame table by suspending whole processes
+struct load_control_t {
+    unsigned long tau;
+    std::vector<working_set_t> processes;       // indexed by process id
+    std::deque<int> suspended;                  // resume order
+    long total = 0;                             // working set sizes of running processes
+    int deferring = -1;                         // suspended process whose slice is being read
+    unsigned long thrash_time = 0;              // instructions run with total > frames
+    unsigned long suspensions = 0;
+    unsigned long resumes = 0;
+};
+
+// Frame quota of one process under local replacement, adjusted by its
+// page fault frequency measured in the process' own virtual time
+struct pff_quota_t {
+    int quota = 0;                              // 0 until the first fault
+    std::set<int> frames;                       // frames held as primary mapper, in frame order
+    unsigned long vtime = 0;                    // r/w instructions of the process
+    unsigned long last_fault = 0;               // vtime of the previous fault
+    unsigned long faults = 0;
+    unsigned long grows = 0;
+    unsigned long shrinks = 0;
+};
+
+// Local replacement: a faulting process only replaces its own frames
+struct local_replacement_t {
+    int lower;                                  // faults per 1000 references below which the quota shrinks
+    int upper;                                  // faults per 1000 references above which the quota grows
+    std::vector<pff_quota_t> processes;         // indexed by process id
+
+    pff_quota_t& process(int pid) {
+        if (pid >= (int)processes.size()) {
+            processes.resize(pid + 1);
+        }
+        return processes[pid];
+    }
+};
+
+// Slow memory tier: frames num_frames.. of the frame table. The pager only
+// manages the fast tier; its victims are demoted here instead of evicted,
+// and pages referenced in consecutive hotness scans are promoted back.
+struct memory_tiers_t {
+    int slow_frames;
+    unsigned long slow_access_cost;             // cost of a reference served by the slow tier
+    std::deque<int> free_list;                  // free slow frames
+    std::vector<uint32_t> age;                  // hotness (Aging counter) per slow frame
+    unsigned long next_scan = TIER_SCAN_INTERVAL;
+    int hand = 0;                               // clock hand of the hotness scan and the demotion search
+};
+
+// Swap area, divided into clusters of `cluster` adjacent slots. Every
+// swapped-out PTE and every resident page with a valid copy holds a reference
+// on its slot. Slots are handed out in order from one cluster at a time, and
+// the pages one reclaim writes out are charged as one write per cluster; a
+// read brings in the swapped-out pages of the following slots of the cluster
+// as well.
+struct swap_device_t {
+    int cluster = 1;
+    std::vector<int> refs;                      // per slot, 0 if free
+    std::vector<int> resident;                  // references held by resident pages, per slot
+    std::vector<int> used;                      // slots with references, per cluster
+    std::set<int> free_clusters;                // clusters with no slot in use
+    int next_slot = 0;                          // next slot of the cluster being filled
+    int run_end = 0;                            // end of that cluster
+    int pending = 0;                            // pages of the write being filled by the current reclaim
+    std::vector<int> readahead;                 // swap cache: slots read ahead, not yet faulted, oldest first
+    std::vector<uint8_t> cached;                // per slot, 1 if in the swap cache
+    unsigned long write_ios = 0;
+    unsigned long write_pages = 0;
+    unsigned long read_ios = 0;
+    unsigned long read_pages = 0;
+    unsigned long readahead_hits = 0;
 };
 
+struct simulation_stats {
+    global_stats global;
+    std::vector<process_stats> processes;   // indexed by process id
+    unsigned long long cost;
+    unsigned long thrash_time;
+    unsigned long suspensions;
+    std::vector<int> quotas;                // frame quota per process, empty without local replacement
+    unsigned long write_ios;                // swap I/O
+    unsigned long write_pages;
+    unsigned long read_ios;
+    unsigned long read_pages;
+    unsigned long readahead_hits;
+};
+
+struct simulator_config {
+    int num_frames = 128;
+    char algo = 'f';
+    const Randomizer* randomizer = nullptr;     // required by the Random pager, not owned
+    unsigned long tau = 50;                     // Working Set window, in instructions
+    bool load_control = false;                  // suspend processes when working sets exceed memory
+    bool local_replacement = false;             // per-process frame quotas adjusted by fault frequency
+    int pff_lower = 10;                         // faults per 1000 references
+    int pff_upper = 100;
+    int slow_frames = 0;                        // frames of a slow memory tier, 0 for a single tier
+    unsigned long slow_access_cost = 3;         // per reference, a fast-tier reference costs 1
+    int swap_cluster = 1;                       // pages per swap write/read I/O
+    std::ostream* delta_trace = nullptr;        // PTE/frame changes per instruction, not owned
+    simulator_options options;
+};
+
+// One simulation run: owns the frame table, the processes, the pager and the
+// statistics. Fill processes() (e.g. with readInput()) or pass a parsed spec,
+// feed instructions with step()/run() and call finish() at the end of the
+// trace for the summary output.
+class Simulator {
+public:
+    Simulator(const simulator_config& config, OutputSink* output_sink = nullptr);
+    Simulator(const simulator_config& config, const process_arena& spec, OutputSink* output_sink = nullptr);
+    ~Simulator();
+
+    process_arena& processes() { return arena; }
+    void step(const instruction_t& instruction);
+    void run(std::span<const instruction_t> instructions);
+    void finish();
+    simulation_stats stats() const;
+
+private:
+    frame_t* allocate_frame_from_free_list();
+    frame_t* get_frame(process_object* process);
+    frame_t* reclaim_frames();
+    void evict_frame(frame_t* frame);
+    void uncache_frame(frame_t* frame);
+    void release_frame(frame_t* frame);
+    bool pagefault_handler(process_object* process, int vpage);
+    void cow_fault_handler(process_object* process, int vpage);
+    void fork_process(process_object* parent, int child_id);
+    void exit_process(process_object* process);
+    void execute(const instruction_t& instruction);
+    void execute_instruction(const instruction_t& instruction);
+    size_t skip_resident_hits(std::span<const instruction_t> instructions);
+
+    working_set_t& working_set(int pid);
+    void update_working_set(int pid);
+    void load_control_switch(const instruction_t& instruction);
+    void suspend_process(int pid);
+    void resume_process(int pid);
+    void swap_out_process(process_object* process);
+
+    pff_quota_t& pff_quota(int pid);
+    frame_t* allocate_local_frame(process_object* process);
+    void printQuotas();
+
+    frame_t* slow_frame();
+    void demote_frame(frame_t* frame);
+    void promote_frame(frame_t* frame);
+    void exchange_frames(frame_t* a, frame_t* b);
+    void retarget_frame(frame_t* frame);
+    void scan_slow_tier();
+    uint32_t age_slow_frame(int index);
+
+    int swap_write();
+    void swap_read(int slot);
+    void uncache_slot(int slot);
+    void flush_swap_writes();
+    int find_swap_run();
+    void set_swap_slot(pte_t& pte, int slot);
+    void drop_swap_slot(int slot);
+    void drop_frame_slot(frame_t* frame);
+    void wait_for_slot(frame_t* frame, int pid, int vpage);
+    void resolve_slot_waiters(frame_t* frame, int slot);
+    void cancel_slot_wait(int pid, int vpage);
+
+    void record_delta();
+
+    unsigned long long total_cost() const;
+    void printProcessStatistics(process_object* current_process);
+    void printGlobalStatistics();
+    void printPageTable(process_object* current_process);
+    void printFrameTable();
+
+    simulator_options options;
+    StdoutSink stdout_sink;
+    OutputSink* sink;
+    int num_frames;
+    process_arena arena;
+    frame_table_t frame_table;
+    std::deque<int> free_list;
+    page_cache_t page_cache;
+    std::unique_ptr<pagerClass> pager;
+    global_stats gstats;
+    process_object* current_process;
+    int instruction_number;
+    bool fast_forward;          // collapse runs of hits, off while tracing every instruction
+    std::unique_ptr<load_control_t> load_control;
+    std::unique_ptr<local_replacement_t> local_replacement;
+    std::unique_ptr<memory_tiers_t> tiers;
+    swap_device_t swap;
+    std::map<int, int> slot_waits;  // waiting PTE -> frame, see frame_cold_t::slot_waiters
+    std::unique_ptr<delta_trace_t> delta;
+};
+
+// Input parsing, shared by the command line tool and embedders
+std::string readLine(std::istream& file);
+void readInput(std::istream& file, process_arena &processes);
+void printProcesses(process_arena &processes, OutputSink* sink, const simulator_options& options);
+VMA* find_vma(process_object* process, int vpage);
+
+// Table snapshots, shared with the delta trace replay tool
+void printPageTable(OutputSink* sink, int process_id, const pte_t* page_table);
+void printFrameTable(OutputSink* sink, const frame_t* frames, int size, int num_frames);
+
 #endif // MMU_H
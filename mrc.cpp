@@ -0,0 +1,265 @@
+
+#include "mrc.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+
+// ====================|  Sampling  |===========================
+
+
+// splitmix64 finalizer: low bits decide sampling, high bits the error group
+static uint64_t mix_key(uint64_t key) {
+    key += 0x9e3779b97f4a7c15ULL;
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return key ^ (key >> 31);
+}
+
+
+MissRatioCurve::MissRatioCurve(const mrc_config& config, process_arena& processes) :
+    arena(processes),
+    max_keys(config.max_keys),
+    current_pid(-1),
+    references(0),
+    sampled(0),
+    tree(1024, 0),
+    clock(0),
+    marks(0) {
+
+    if (!(config.rate > 0 && config.rate <= 1)) {
+        throw std::invalid_argument("Invalid sampling rate");
+    }
+    if (config.max_frames < 1) {
+        throw std::invalid_argument("Invalid number of frames");
+    }
+    threshold = std::max<uint32_t>(1, (uint32_t)std::lround(config.rate * MRC_HASH_MODULUS));
+    rate = (double)threshold / MRC_HASH_MODULUS;
+
+    if (config.max_frames <= MRC_MAX_POINTS) {
+        for (int frames = 1; frames <= config.max_frames; frames++) {
+            frame_counts.push_back(frames);
+        }
+    }
+    else {
+        for (int i = 1; i <= MRC_MAX_POINTS; i++) {
+            frame_counts.push_back((int)((long)i * config.max_frames / MRC_MAX_POINTS));
+        }
+    }
+    histograms.assign(MRC_GROUPS, std::vector<double>(frame_counts.size() + 1, 0));
+
+    for (int pid = 0; pid < arena.size(); pid++) {
+        vma_owner.push_back(pid);
+    }
+}
+
+
+// Only the sampled references do more than a hash and a compare
+void MissRatioCurve::run(std::span<const instruction_t> instructions) {
+    for (const instruction_t& instruction : instructions) {
+        switch (instruction.op) {
+            case 'r':
+            case 'w':
+                references++;
+                access(current_pid, instruction.arg);
+                break;
+            case 'c':
+                current_pid = instruction.arg;
+                break;
+            case 'e':
+                exit_process(current_pid);
+                break;
+            case 'f':
+                // The child maps the VMAs of its parent
+                if (instruction.arg >= 0 && current_pid >= 0 && current_pid < (int)vma_owner.size()) {
+                    if (instruction.arg >= (int)vma_owner.size()) {
+                        vma_owner.resize(instruction.arg + 1, -1);
+                    }
+                    vma_owner[instruction.arg] = vma_owner[current_pid];
+                }
+                break;
+        }
+    }
+}
+
+
+void MissRatioCurve::access(int pid, int vpage) {
+    if (pid < 0 || vpage < 0 || vpage >= MAX_VPAGES) {
+        return;
+    }
+    uint64_t key = ((uint64_t)pid << 8) | (uint64_t)vpage;
+    uint64_t mixed = mix_key(key);
+    uint32_t hash = mixed & (MRC_HASH_MODULUS - 1);
+    if (hash >= threshold) {
+        return;
+    }
+    // References outside the VMAs are SEGVs, they never occupy a frame
+    if (pid >= (int)vma_owner.size() || vma_owner[pid] < 0 || find_vma(&arena[vma_owner[pid]], vpage) == nullptr) {
+        return;
+    }
+    sampled++;
+    int group = (mixed >> 32) % MRC_GROUPS;
+
+    if (clock + 1 >= tree.size()) {
+        compact();
+    }
+    auto it = keys.find(key);
+    if (it == keys.end()) {
+        histograms[group].back() += 1;
+        keys.emplace(key, key_entry{++clock, hash});
+        mark(clock, 1);
+        if (max_keys > 0) {
+            by_hash.insert({hash, key});
+            if (keys.size() > max_keys) {
+                lower_rate();
+            }
+        }
+        return;
+    }
+    // Distinct sampled keys touched since the last access, scaled to all keys
+    int distance = marked_after(it->second.time);
+    record(group, distance / rate);
+    mark(it->second.time, -1);
+    it->second.time = ++clock;
+    mark(clock, 1);
+}
+
+
+// Pages of an exited process are freed, they leave the LRU stack. A bounded
+// table would have evicted other pages for them, so this is an approximation
+// of LRU with frees, not an exact one.
+void MissRatioCurve::exit_process(int pid) {
+    if (pid < 0) {
+        return;
+    }
+    for (int vpage = 0; vpage < MAX_VPAGES; vpage++) {
+        uint64_t key = ((uint64_t)pid << 8) | (uint64_t)vpage;
+        auto it = keys.find(key);
+        if (it != keys.end()) {
+            forget(key, it->second);
+        }
+    }
+}
+
+
+void MissRatioCurve::forget(uint64_t key, const key_entry& entry) {
+    mark(entry.time, -1);
+    if (max_keys > 0) {
+        by_hash.erase({entry.hash, key});
+    }
+    keys.erase(key);
+}
+
+
+// A reuse at the given (scaled) distance faults at every frame count up to it
+void MissRatioCurve::record(int group, double distance) {
+    size_t bucket = std::upper_bound(frame_counts.begin(), frame_counts.end(), distance) - frame_counts.begin();
+    histograms[group][bucket] += 1;
+}
+
+
+// Fixed-size sampling: drop the keys with the largest hashes until the sample
+// fits, and rescale what was counted at the old rate to the new one
+void MissRatioCurve::lower_rate() {
+    while (keys.size() > max_keys) {
+        uint32_t new_threshold = by_hash.rbegin()->first;
+        if (new_threshold < 1) {
+            break;
+        }
+        while (!by_hash.empty() && by_hash.rbegin()->first >= new_threshold) {
+            uint64_t key = by_hash.rbegin()->second;
+            forget(key, keys.at(key));
+        }
+        double new_rate = (double)new_threshold / MRC_HASH_MODULUS;
+        for (auto& histogram : histograms) {
+            for (double& count : histogram) {
+                count *= new_rate / rate;
+            }
+        }
+        threshold = new_threshold;
+        rate = new_rate;
+    }
+}
+
+
+// ====================|  Stack Distances  |===========================
+
+
+// Renumber the live keys 1..n in access order, the tree only grows with the sample
+void MissRatioCurve::compact() {
+    std::vector<std::pair<uint32_t, uint64_t>> order;
+    order.reserve(keys.size());
+    for (auto& [key, entry] : keys) {
+        order.push_back({entry.time, key});
+    }
+    std::sort(order.begin(), order.end());
+
+    tree.assign(std::max<size_t>(1024, 2 * keys.size() + 2), 0);
+    clock = 0;
+    marks = 0;
+    for (auto& [time, key] : order) {
+        keys[key].time = ++clock;
+        mark(clock, 1);
+    }
+}
+
+
+void MissRatioCurve::mark(uint32_t time, int delta) {
+    for (size_t i = time; i < tree.size(); i += i & (~i + 1)) {
+        tree[i] += delta;
+    }
+    marks += delta;
+}
+
+
+int MissRatioCurve::marked_after(uint32_t time) const {
+    int before = 0;
+    for (size_t i = time; i > 0; i -= i & (~i + 1)) {
+        before += tree[i];
+    }
+    return marks - before;
+}
+
+
+// ====================|  Results  |===========================
+
+
+std::vector<mrc_point> MissRatioCurve::points() const {
+    std::vector<mrc_point> result;
+    for (size_t j = 0; j < frame_counts.size(); j++) {
+        double group_misses[MRC_GROUPS];
+        double misses = 0;
+        for (int g = 0; g < MRC_GROUPS; g++) {
+            group_misses[g] = 0;
+            for (size_t bucket = j + 1; bucket < histograms[g].size(); bucket++) {
+                group_misses[g] += histograms[g][bucket];
+            }
+            misses += group_misses[g];
+        }
+        misses /= rate;
+
+        // Each group alone is a sample at rate / MRC_GROUPS
+        double variance = 0;
+        for (int g = 0; g < MRC_GROUPS; g++) {
+            double estimate = group_misses[g] * MRC_GROUPS / rate;
+            variance += (estimate - misses) * (estimate - misses);
+        }
+        variance /= MRC_GROUPS - 1;
+        // Finite population correction: a full sample (rate 1) has no sampling error
+        variance *= (1 - rate) / (1 - rate / MRC_GROUPS);
+        result.push_back({frame_counts[j], misses, 2 * std::sqrt(variance / MRC_GROUPS)});
+    }
+    return result;
+}
+
+
+void MissRatioCurve::print(OutputSink* sink) const {
+    sink->printf("MRC refs=%lu sampled=%lu rate=%.6f keys=%zu\n", references, sampled, rate, keys.size());
+    for (const mrc_point& point : points()) {
+        sink->printf("MRC[%d]: misses=%.0f +-%.0f ratio=%.4f\n",
+                point.frames,
+                point.misses,
+                point.error,
+                references ? point.misses / references : 0.0);
+    }
+}
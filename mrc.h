@@ -0,0 +1,80 @@
+#ifndef MRC_H
+#define MRC_H
+
+#include <cstdint>
+#include <set>
+#include <span>
+#include <unordered_map>
+#include <vector>
+#include "mmu.h"
+
+#define MRC_HASH_MODULUS    (1 << 24)   // sampling threshold resolution
+#define MRC_GROUPS          8           // independent sub-samples for the error bound
+#define MRC_MAX_POINTS      64          // frame counts reported
+
+struct mrc_config {
+    int max_frames = 128;               // largest frame count reported
+    double rate = 0.01;                 // fraction of (process, vpage) keys sampled
+    size_t max_keys = 0;                // lower the rate to keep at most this many keys, 0 for no limit
+};
+
+// Estimated faults of an LRU frame table with a given number of frames
+struct mrc_point {
+    int frames;
+    double misses;
+    double error;                       // about two standard errors of the estimate
+};
+
+// Approximate miss ratio curve of a trace (SHARDS). References are sampled
+// by a hash of their (process id, vpage) key, so every reference to a sampled
+// page is seen; LRU stack distances are computed over the sample only and
+// scaled by 1/rate. Sampled keys are split into groups by another part of the
+// hash, and the spread of the per-group estimates gives the error bound.
+class MissRatioCurve {
+public:
+    MissRatioCurve(const mrc_config& config, process_arena& processes);
+
+    void run(std::span<const instruction_t> instructions);
+    std::vector<mrc_point> points() const;
+    void print(OutputSink* sink) const;
+
+private:
+    struct key_entry {
+        uint32_t time;                  // position of the last access in the stack
+        uint32_t hash;
+    };
+
+    void access(int pid, int vpage);
+    void exit_process(int pid);
+    void forget(uint64_t key, const key_entry& entry);
+    void record(int group, double distance);
+    void lower_rate();
+    void compact();
+
+    void mark(uint32_t time, int delta);
+    int marked_after(uint32_t time) const;
+
+    process_arena& arena;
+    std::vector<int> vma_owner;         // process whose VMAs a (forked) process uses
+    size_t max_keys;
+    uint32_t threshold;                 // keys with hash < threshold are sampled
+    double rate;
+    int current_pid;
+
+    unsigned long references;
+    unsigned long sampled;
+    std::unordered_map<uint64_t, key_entry> keys;
+    std::set<std::pair<uint32_t, uint64_t>> by_hash;    // for lowering the rate, only with max_keys
+
+    // Fenwick tree over access times, one mark per key at its last access
+    std::vector<int> tree;
+    uint32_t clock;
+    int marks;
+
+    std::vector<int> frame_counts;      // reported frame counts, ascending
+    // Sampled references per group, bucketed by the number of frame counts
+    // they hit at; the last bucket holds cold misses
+    std::vector<std::vector<double>> histograms;
+};
+
+#endif // MRC_H
@@ -0,0 +1,170 @@
+#include "mmu.h"
+#include "getopt.h"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+
+// ====================|  Delta Trace Replay  |===========================
+//
+// Rebuilds page and frame table snapshots from a delta trace written by
+// `mmu -d`, in the format of `mmu -oP`/`-oF`.
+
+class DeltaReader {
+public:
+    DeltaReader(std::istream& stream) : in(stream) {}
+
+    int byte() {
+        int c = in.get();
+        if (c == EOF) {
+            throw std::runtime_error("Truncated delta trace");
+        }
+        return c;
+    }
+
+    uint64_t varint() {
+        uint64_t value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            int c = byte();
+            value |= (uint64_t)(c & 0x7f) << shift;
+            if (!(c & 0x80)) {
+                return value;
+            }
+        }
+        throw std::runtime_error("Invalid delta trace");
+    }
+
+    bool at_end() { return in.peek() == EOF; }
+
+private:
+    std::istream& in;
+};
+
+
+static pte_t pte_of_flags(int flags) {
+    pte_t pte = {0, 0, 0, 0, 0, 0};
+    pte.PRESENT = (flags & DELTA_PRESENT) != 0;
+    pte.REFERENCED = (flags & DELTA_REFERENCED) != 0;
+    pte.MODIFIED = (flags & DELTA_MODIFIED) != 0;
+    pte.WRITE_PROTECT = (flags & DELTA_WRITE_PROTECT) != 0;
+    pte.PAGEDOUT = (flags & DELTA_PAGEDOUT) != 0;
+    pte.COPY_ON_WRITE = (flags & DELTA_COPY_ON_WRITE) != 0;
+    return pte;
+}
+
+
+// ====================|  Main  |===========================
+int main(int argc, char **argv) {
+    bool show_pagetable = true;
+    bool show_frametable = true;
+    std::vector<long> snapshots;        // instruction numbers, ascending
+    int c;
+
+    while ((c = getopt(argc, argv, "o:n:")) != -1) {
+        switch(c) {
+            case 'o':
+                show_pagetable = strchr(optarg, 'P') != nullptr;
+                show_frametable = strchr(optarg, 'F') != nullptr;
+                break;
+            case 'n':
+                // <instruction>[,<instruction>...] as numbered by -oO
+                for (char* number = strtok(optarg, ","); number; number = strtok(nullptr, ",")) {
+                    snapshots.push_back(atol(number));
+                }
+                break;
+        }
+    }
+    if (argc - optind != 1) {
+        std::cout << "usage: mmu-replay [-o<PF>] [-n<instruction>[,...]] deltafile" << std::endl;
+        exit(1);
+    }
+    std::sort(snapshots.begin(), snapshots.end());
+
+    try {
+        std::ifstream file(argv[optind], std::ios::binary);
+        if (!file) {
+            throw std::runtime_error(std::string("Cannot open ") + argv[optind]);
+        }
+        DeltaReader reader(file);
+        for (const char* magic = DELTA_MAGIC; *magic; magic++) {
+            if (reader.byte() != *magic) {
+                throw std::runtime_error("Not a delta trace");
+            }
+        }
+        if (reader.byte() != DELTA_VERSION) {
+            throw std::runtime_error("Unsupported delta trace version");
+        }
+        int num_frames = (int)reader.varint();
+        int slow_frames = (int)reader.varint();
+        if (num_frames < 1 || (long)num_frames + slow_frames > MAX_FRAMES) {
+            throw std::runtime_error("Invalid delta trace");
+        }
+
+        std::vector<std::array<pte_t, MAX_VPAGES>> page_tables;
+        std::vector<frame_t> frames(num_frames + slow_frames, frame_t{FRAME_FREE, 0});
+        StdoutSink sink;
+        auto print = [&]() {
+            if (show_pagetable) {
+                for (int pid = 0; pid < (int)page_tables.size(); pid++) {
+                    printPageTable(&sink, pid, page_tables[pid].data());
+                }
+            }
+            if (show_frametable) {
+                printFrameTable(&sink, frames.data(), (int)frames.size(), num_frames);
+            }
+        };
+
+        // A group holds the changes up to and including its last instruction
+        size_t next = 0;
+        unsigned long instructions = 0;
+        while (!reader.at_end()) {
+            int type = reader.byte();
+            switch (type) {
+                case 'I':
+                    instructions += reader.varint();
+                    // Snapshots of instructions before this group see the state so far
+                    while (next < snapshots.size() && snapshots[next] + 1 < (long)instructions) {
+                        print();
+                        next++;
+                    }
+                    break;
+                case 'N':
+                    page_tables.resize(reader.varint(), std::array<pte_t, MAX_VPAGES>{});
+                    break;
+                case 'P': {
+                    uint64_t pid = reader.varint();
+                    int vpage = reader.byte();
+                    int flags = reader.byte();
+                    if (pid >= page_tables.size() || vpage >= MAX_VPAGES) {
+                        throw std::runtime_error("Invalid delta trace");
+                    }
+                    page_tables[pid][vpage] = pte_of_flags(flags);
+                    break;
+                }
+                case 'F': {
+                    uint64_t frame_id = reader.varint();
+                    uint64_t process = reader.varint();
+                    int vpage = reader.byte();
+                    if (frame_id >= frames.size() || vpage >= MAX_VPAGES) {
+                        throw std::runtime_error("Invalid delta trace");
+                    }
+                    frames[frame_id].pte = process == 0 ? FRAME_FREE : (int)(process - 1) * MAX_VPAGES + vpage;
+                    break;
+                }
+                default:
+                    throw std::runtime_error("Invalid delta trace record");
+            }
+        }
+        if (snapshots.empty()) {
+            print();
+        }
+        for (; next < snapshots.size(); next++) {
+            print();
+        }
+    }
+    catch (const std::exception& e) {
+        fflush(stdout);
+        std::cout << e.what() << std::endl;
+        exit(1);
+    }
+}
@@ -0,0 +1,200 @@
+
+#include "trace_reader.h"
+#include <algorithm>
+#include <cctype>
+
+#define TRACE_CHUNK_SIZE    (256 * 1024)    // bytes of input per chunk
+#define TRACE_RING_SIZE     (1 << 16)       // records per decoder ring
+#define TRACE_FLUSH_SIZE    4096            // records published at once
+
+
+// ====================|  Ring Buffer  |===========================
+
+
+RingBuffer::RingBuffer(size_t capacity) : slots(capacity), mask(capacity - 1), head(0), tail(0) {}
+
+size_t RingBuffer::push(const instruction_t* records, size_t count) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    size_t n = std::min(count, slots.size() - (t - h));
+    for (size_t i = 0; i < n; i++) {
+        slots[(t + i) & mask] = records[i];
+    }
+    tail.store(t + n, std::memory_order_release);
+    return n;
+}
+
+size_t RingBuffer::pop(instruction_t* records, size_t max) {
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t n = std::min(max, t - h);
+    size_t i = 0;
+    // Stop after a control record, whatever follows belongs to a later chunk
+    while (i < n) {
+        records[i] = slots[(h + i) & mask];
+        i++;
+        if (records[i - 1].op == TRACE_CHUNK_END || records[i - 1].op == TRACE_END) {
+            break;
+        }
+    }
+    head.store(h + i, std::memory_order_release);
+    return i;
+}
+
+
+// ====================|  Trace Reader  |===========================
+
+
+TraceReader::TraceReader(const std::string& path_input, long start_offset_input, int num_decoders_input) :
+    path(path_input),
+    start_offset(start_offset_input),
+    num_decoders(std::max(1, num_decoders_input)),
+    current(0),
+    finished(false),
+    stopping(false) {
+
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    file_size = file ? (long)file.tellg() : 0;
+    if (start_offset < 0 || start_offset > file_size) {
+        start_offset = file_size;
+    }
+
+    for (int i = 0; i < num_decoders; i++) {
+        rings.push_back(new RingBuffer(TRACE_RING_SIZE));
+    }
+    for (int i = 0; i < num_decoders; i++) {
+        decoders.emplace_back(&TraceReader::decode, this, i);
+    }
+}
+
+TraceReader::~TraceReader() {
+    stopping = true;
+    for (auto& decoder : decoders) {
+        decoder.join();
+    }
+    for (auto ring : rings) {
+        delete ring;
+    }
+}
+
+size_t TraceReader::next_batch(instruction_t* out, size_t max) {
+    size_t n = 0;
+    while (!finished && n < max) {
+        size_t got = rings[current]->pop(out + n, max - n);
+        if (got == 0) {
+            if (n > 0) break;
+            std::this_thread::yield();
+            continue;
+        }
+        char op = out[n + got - 1].op;
+        if (op == TRACE_CHUNK_END) {
+            n += got - 1;
+            current = (current + 1) % num_decoders;
+        }
+        else if (op == TRACE_END) {
+            n += got - 1;
+            finished = true;
+        }
+        else {
+            n += got;
+        }
+    }
+    return n;
+}
+
+// Decoder thread: handles chunks decoder, decoder + n, decoder + 2n, ...
+void TraceReader::decode(int decoder) {
+    std::ifstream file(path, std::ios::binary);
+    std::vector<instruction_t> records;
+    RingBuffer& ring = *rings[decoder];
+
+    for (long k = decoder; ; k += num_decoders) {
+        long chunk_begin = start_offset + k * (long)TRACE_CHUNK_SIZE;
+        if (chunk_begin >= file_size) {
+            instruction_t end = {0, TRACE_END};
+            publish(ring, &end, 1);
+            return;
+        }
+        if (!decode_chunk(file, chunk_begin, ring, records)) {
+            return;
+        }
+    }
+}
+
+// Parse the lines starting inside [chunk_begin, chunk_begin + TRACE_CHUNK_SIZE),
+// returns false if the trace ended in this chunk or the reader is shutting down
+bool TraceReader::decode_chunk(std::ifstream& file, long chunk_begin, RingBuffer& ring, std::vector<instruction_t>& records) {
+    long chunk_end = std::min(chunk_begin + (long)TRACE_CHUNK_SIZE, file_size);
+    // One byte of look-behind tells whether a line starts exactly at chunk_begin
+    long read_begin = chunk_begin > start_offset ? chunk_begin - 1 : chunk_begin;
+    std::string buffer(chunk_end - read_begin, '\0');
+    file.clear();
+    file.seekg(read_begin);
+    file.read(&buffer[0], buffer.size());
+
+    // Finish the last line, which may run into the next chunk
+    long read_end = chunk_end;
+    while (read_end < file_size && buffer.back() != '\n') {
+        char c;
+        if (!file.get(c)) break;
+        buffer.push_back(c);
+        read_end++;
+    }
+
+    size_t pos = 0;
+    size_t owned_end = chunk_end - read_begin;
+    if (read_begin < chunk_begin) {
+        size_t newline = buffer.find('\n');
+        pos = (newline == std::string::npos) ? buffer.size() : newline + 1;
+    }
+
+    records.clear();
+    while (pos < owned_end) {
+        size_t line_end = buffer.find('\n', pos);
+        if (line_end == std::string::npos) line_end = buffer.size();
+        const char* p = buffer.data() + pos;
+        const char* end = buffer.data() + line_end;
+        pos = line_end + 1;
+
+        // Same rules as readLine(): comments are skipped, an empty line ends the trace
+        if (p == end) {
+            records.push_back({0, TRACE_END});
+            publish(ring, records.data(), records.size());
+            return false;
+        }
+        if (*p == '#') {
+            continue;
+        }
+
+        instruction_t record = {0, '?'};
+        while (p < end && isspace((unsigned char)*p)) p++;
+        if (p < end) record.op = *p++;
+        while (p < end && isspace((unsigned char)*p)) p++;
+        bool negative = (p < end && *p == '-');
+        if (negative) p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            record.arg = record.arg * 10 + (*p++ - '0');
+        }
+        if (negative) record.arg = -record.arg;
+        records.push_back(record);
+
+        if (records.size() == TRACE_FLUSH_SIZE) {
+            if (!publish(ring, records.data(), records.size())) return false;
+            records.clear();
+        }
+    }
+    records.push_back({0, TRACE_CHUNK_END});
+    return publish(ring, records.data(), records.size());
+}
+
+// Hand records to the consumer, waiting while the ring is full
+bool TraceReader::publish(RingBuffer& ring, const instruction_t* records, size_t count) {
+    while (count > 0) {
+        if (stopping) return false;
+        size_t n = ring.push(records, count);
+        records += n;
+        count -= n;
+        if (n == 0) std::this_thread::yield();
+    }
+    return true;
+}
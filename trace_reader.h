@@ -0,0 +1,67 @@
+#ifndef TRACE_READER_H
+#define TRACE_READER_H
+
+#include <atomic>
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Packed trace instruction handed from the decoders to the simulation
+typedef struct {
+    int arg;
+    char op;
+} instruction_t;
+
+// Control records that never reach the simulation
+#define TRACE_CHUNK_END '\0'    // decoder finished one chunk, continue with the next ring
+#define TRACE_END       '\1'    // no more instructions (end of file or first empty line)
+
+// Lock-free single-producer/single-consumer ring of instruction records
+class RingBuffer {
+public:
+    RingBuffer(size_t capacity);
+
+    // Producer side: copy as many records as fit, returns how many were taken
+    size_t push(const instruction_t* records, size_t count);
+    // Consumer side: copy up to max records out, returns how many were taken
+    size_t pop(instruction_t* records, size_t max);
+
+private:
+    std::vector<instruction_t> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head;   // next slot to read, owned by the consumer
+    alignas(64) std::atomic<size_t> tail;   // next slot to write, owned by the producer
+};
+
+// Decodes the instruction part of an input file on background threads.
+// The file is split into fixed-size, line-aligned chunks; chunk k is parsed
+// by decoder k % n and published through that decoder's ring, so reading
+// the rings round-robin delivers the instructions in file order.
+class TraceReader {
+public:
+    TraceReader(const std::string& path, long start_offset, int num_decoders);
+    ~TraceReader();
+
+    // Fill up to max instructions, returns 0 once the trace is exhausted.
+    // Never touches the file, only waits for the decoders when the ring is empty.
+    size_t next_batch(instruction_t* out, size_t max);
+
+private:
+    void decode(int decoder);
+    bool decode_chunk(std::ifstream& file, long chunk_begin, RingBuffer& ring, std::vector<instruction_t>& records);
+    bool publish(RingBuffer& ring, const instruction_t* records, size_t count);
+
+    std::string path;
+    long start_offset;
+    long file_size;
+    int num_decoders;
+    int current;                // ring holding the next chunk in file order
+    bool finished;
+    std::atomic<bool> stopping;
+    std::vector<RingBuffer*> rings;
+    std::vector<std::thread> decoders;
+};
+
+#endif // TRACE_READER_H